@@ -0,0 +1,349 @@
+#ifndef CompactTasks_h
+#define CompactTasks_h
+
+/**
+ * @file CompactTasks.h
+ * @author PhoneDeveloper, LLC
+ * @brief A version of Tasks that fits many more pending tasks into RAM
+ *
+ * CompactTasks schedules and dispatches functions just like Tasks, but
+ * stores its pending tasks in a fixed-size array inside the CompactTasks
+ * instance, instead of creating an object on the heap for each one.
+ *
+ * To save RAM, each pending task is a small plain struct:
+ * - tasks are linked by their index in the array, a byte (or, if you ask
+ *   for more than 254 tasks, a 16-bit integer) rather than a pointer;
+ * - the time a task is due is kept in 16 bits, as the number of
+ *   milliseconds after a time (the epoch) shared by all the tasks;
+ * - a tag byte records the kind of callback, instead of a pointer to
+ *   a table of virtual methods.
+ * BYTES_PER_TASK tells you how much RAM each task takes; on AVR it is 8.
+ *
+ * The price is that fewer kinds of callbacks can be scheduled (those whose
+ * parameter fits in a pointer) and that the delay can be no longer than
+ * 65535 milliseconds. schedule() returns false if the delay is too long
+ * or if every task in the array is already pending.
+ *
+ * Example: CompactTasks<32> tasks; // up to 32 pending tasks
+ *
+ * The index type is chosen from size, but can be given as a second
+ * template parameter: CompactTasks<32, uint16_t>.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "Tasks.h"
+
+/*
+ * The smallest index that can number size tasks and still have a value
+ * left over to mean "no task": a byte up to 254 tasks, 16 bits above.
+ */
+template <bool fitsInByte>
+struct CompactTasksIndex
+{
+    typedef uint8_t Type;
+};
+template <>
+struct CompactTasksIndex<false>
+{
+    typedef uint16_t Type;
+};
+
+template <unsigned int size, typename Index = typename CompactTasksIndex<(size < 255)>::Type>
+class CompactTasks
+{
+private:
+    /*
+     * Tells dispatch() how to call a task's callback.
+     */
+    enum Tag
+    {
+        TAKES_NOTHING,
+        TAKES_BOOL,
+        TAKES_CHAR,
+        TAKES_UNSIGNED_CHAR,
+        TAKES_INT,
+        TAKES_UNSIGNED_INT,
+        TAKES_VOID_POINTER,
+        CALLABLE
+    };
+
+    /*
+     * A pending (or free) task. Callbacks are stored as a Callback, and
+     * cast back to their real type according to tag when called.
+     */
+    struct Node
+    {
+        Index next;
+        byte tag;
+        uint16_t deadline; // milliseconds after epoch
+        union
+        {
+            Callback function;
+            Callable* listener;
+        };
+        union
+        {
+            bool boolValue;
+            char charValue;
+            unsigned char unsignedCharValue;
+            int intValue;
+            unsigned int unsignedIntValue;
+            void* pointer;
+        };
+    };
+
+    static const Index NONE = (Index) ~0;
+    static_assert(size > 0 && size < (Index) ~0, "size must fit in the Index type, less one");
+
+    Node nodes[size];
+    Index head = NONE;  // first pending task
+    Index unused = 0;   // first unused node
+    unsigned long epoch = 0;
+
+    Node* allocate(byte tag, Callback callback, unsigned long delay);
+    void rebase();
+
+public:
+    static const size_t BYTES_PER_TASK = sizeof(Node);
+
+    CompactTasks();
+    boolean dispatch();
+
+    bool schedule(Callback callback, unsigned long delay);
+    bool schedule(CallbackTakesBool callback, unsigned long delay, bool value);
+    bool schedule(CallbackTakesChar callback, unsigned long delay, char value);
+    bool schedule(CallbackTakesUnsignedChar callback, unsigned long delay, unsigned char value);
+    bool schedule(CallbackTakesInt callback, unsigned long delay, int value);
+    bool schedule(CallbackTakesUnsignedInt callback, unsigned long delay, unsigned int value);
+    bool schedule(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer);
+    bool schedule(Callable* listener, unsigned long delay, void* pointer = NULL);
+};
+
+/*
+ * Links every node into the list of free nodes.
+ */
+template <unsigned int size, typename Index>
+CompactTasks<size, Index>::CompactTasks()
+{
+    for(unsigned int i = 0; i < size; i++)
+    {
+        nodes[i].next = (i + 1 < size) ? (Index)(i + 1) : NONE;
+    }
+}
+
+/*
+ * dispatch() - calls the first pending task if it is due.
+ *
+ * The node is returned to the free list before the callback is called,
+ * so the callback can schedule itself again even if the array is full.
+ */
+template <unsigned int size, typename Index>
+boolean CompactTasks<size, Index>::dispatch()
+{
+    if((head != NONE) && ((unsigned long)(timer0_millis - epoch) >= nodes[head].deadline))
+    {
+        Index index = head;
+        Node task = nodes[index];
+        head = task.next;
+        nodes[index].next = unused;
+        unused = index;
+
+        switch(task.tag)
+        {
+        case TAKES_NOTHING:
+            task.function();
+            break;
+        case TAKES_BOOL:
+            ((CallbackTakesBool) task.function)(task.boolValue);
+            break;
+        case TAKES_CHAR:
+            ((CallbackTakesChar) task.function)(task.charValue);
+            break;
+        case TAKES_UNSIGNED_CHAR:
+            ((CallbackTakesUnsignedChar) task.function)(task.unsignedCharValue);
+            break;
+        case TAKES_INT:
+            ((CallbackTakesInt) task.function)(task.intValue);
+            break;
+        case TAKES_UNSIGNED_INT:
+            ((CallbackTakesUnsignedInt) task.function)(task.unsignedIntValue);
+            break;
+        case TAKES_VOID_POINTER:
+            ((CallbackTakesVoidPointer) task.function)(task.pointer);
+            break;
+        case CALLABLE:
+            task.listener->callback(task.pointer);
+            break;
+        }
+        return true; // callback was called
+    }
+    if(head == NONE) // nothing pending: move the epoch up for free
+    {
+        epoch = timer0_millis;
+    }
+    return false; // indicate that no scheduled task was called
+}
+
+/*
+ * schedule - requests the supplied function to be run at a later time.
+ *
+ * Same as Tasks::schedule(), but the delay can be no longer than 65535
+ * milliseconds. Returns false if the delay is too long or no node is free.
+ */
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(Callback callback, unsigned long delay)
+{
+    return allocate(TAKES_NOTHING, callback, delay) != NULL;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesBool callback, unsigned long delay, bool value)
+{
+    Node* task = allocate(TAKES_BOOL, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->boolValue = value;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesChar callback, unsigned long delay, char value)
+{
+    Node* task = allocate(TAKES_CHAR, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->charValue = value;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesUnsignedChar callback, unsigned long delay, unsigned char value)
+{
+    Node* task = allocate(TAKES_UNSIGNED_CHAR, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->unsignedCharValue = value;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesInt callback, unsigned long delay, int value)
+{
+    Node* task = allocate(TAKES_INT, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->intValue = value;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesUnsignedInt callback, unsigned long delay, unsigned int value)
+{
+    Node* task = allocate(TAKES_UNSIGNED_INT, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->unsignedIntValue = value;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer)
+{
+    Node* task = allocate(TAKES_VOID_POINTER, (Callback) callback, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->pointer = pointer;
+    return true;
+}
+template <unsigned int size, typename Index>
+bool CompactTasks<size, Index>::schedule(Callable* listener, unsigned long delay, void* pointer)
+{
+    Node* task = allocate(CALLABLE, NULL, delay);
+    if(task == NULL)
+    {
+        return false;
+    }
+    task->listener = listener;
+    task->pointer = pointer;
+    return true;
+}
+
+/*
+ * allocate - takes a free node and places it in the list of pending tasks,
+ * sorted by when it is due (soonest to latest, and after any task due at
+ * the same time). The caller fills in the parameter.
+ */
+template <unsigned int size, typename Index>
+typename CompactTasks<size, Index>::Node* CompactTasks<size, Index>::allocate(byte tag, Callback callback, unsigned long delay)
+{
+    if((unused == NONE) || (delay > 0xFFFFul))
+    {
+        return NULL;
+    }
+    unsigned long deadline = (timer0_millis - epoch) + delay;
+    if(deadline > 0xFFFFul) // doesn't fit in 16 bits? move the epoch up to now
+    {
+        rebase();
+        deadline = delay;
+    }
+
+    Index index = unused;
+    Node* task = &nodes[index];
+    unused = task->next;
+    task->tag = tag;
+    task->function = callback;
+    task->deadline = (uint16_t) deadline;
+
+    Index* link = &head; // the index that refers to current
+    while((*link != NONE) && (nodes[*link].deadline <= task->deadline))
+    {
+        link = &nodes[*link].next;
+    }
+    task->next = *link;
+    *link = index;
+    return task;
+}
+
+/*
+ * rebase - moves the epoch to the current time
+ *
+ * Every pending deadline is made relative to the new epoch. Tasks that
+ * are already due get a deadline of zero, so they stay in the same order.
+ */
+template <unsigned int size, typename Index>
+void CompactTasks<size, Index>::rebase()
+{
+    unsigned long now = timer0_millis;
+    unsigned long elapsed = now - epoch;
+    for(Index index = head; index != NONE; index = nodes[index].next)
+    {
+        nodes[index].deadline = (nodes[index].deadline > elapsed) ? (uint16_t)(nodes[index].deadline - elapsed) : 0;
+    }
+    epoch = now;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef TaskChannel_h
+#define TaskChannel_h
+
+/**
+ * @file TaskChannel.h
+ * @author PhoneDeveloper, LLC
+ * @brief A fixed-size queue of messages between tasks
+ *
+ * A task that produces data for another task could schedule() the consumer
+ * once for every message, but each schedule() creates a task on the heap.
+ * A TaskChannel instead holds up to capacity messages of type T in a ring
+ * buffer, and owns a TaskNode that calls the consumer function. push()
+ * adds a message and arms that node if it isn't armed already, so when
+ * several messages are pushed before dispatch() gets to the consumer, the
+ * consumer is called for all of them in one go: one task per batch of
+ * messages rather than one per message.
+ *
+ * Example:
+ *   void printReading(const int& reading) { Serial.println(reading); }
+ *   TaskChannel<int, 8> readings(&myTask, printReading);
+ *   ...
+ *   readings.push(analogRead(A0));
+ *
+ * Like Tasks, a TaskChannel must only be used from the thread that calls
+ * dispatch(), not from an interrupt handler.
+ *
+ * Destroying a channel drops any messages still waiting: its node disarms
+ * itself, so the consumer is not called for them. A channel can't be
+ * copied, since the copy's node would call back the original.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "Tasks.h"
+
+template <typename T, unsigned int capacity>
+class TaskChannel : public Callable
+{
+public:
+    typedef void (*Consumer)(const T& message);
+
+    TaskChannel(Tasks* tasks, Consumer consumer, unsigned long delay = 0);
+    TaskChannel(const TaskChannel&) = delete;
+    TaskChannel& operator=(const TaskChannel&) = delete;
+    bool push(const T& message);
+    unsigned int available();
+    void callback(void* pointer);
+
+private:
+    Tasks* tasks;
+    Consumer consumer;
+    unsigned long delay; // how long after the first message to call the consumer
+    TaskNode node;
+    T messages[capacity];
+    unsigned int first = 0; // index of the oldest message
+    unsigned int count = 0;
+};
+
+/*
+ * Creates a channel whose messages are passed to consumer by tasks.
+ *
+ * The consumer is called delay milliseconds after a message is pushed
+ * into an empty channel; a longer delay lets more messages collect.
+ */
+template <typename T, unsigned int capacity>
+TaskChannel<T, capacity>::TaskChannel(Tasks* tasks, Consumer consumer, unsigned long delay)
+    : tasks(tasks)
+    , consumer(consumer)
+    , delay(delay)
+    , node(this)
+{
+}
+
+/*
+ * push - copies message into the channel
+ *
+ * Returns false, and drops the message, if the channel is full.
+ */
+template <typename T, unsigned int capacity>
+bool TaskChannel<T, capacity>::push(const T& message)
+{
+    if(count == capacity)
+    {
+        return false;
+    }
+    messages[(first + count) % capacity] = message;
+    count++;
+    if(!node.isArmed()) // first message since the consumer last ran?
+    {
+        tasks->arm(&node, delay);
+    }
+    return true;
+}
+
+/*
+ * available - the number of messages waiting for the consumer
+ */
+template <typename T, unsigned int capacity>
+unsigned int TaskChannel<T, capacity>::available()
+{
+    return count;
+}
+
+/*
+ * callback - called by dispatch(); passes every waiting message to the consumer
+ *
+ * Each message is passed where it lies in the buffer, without copying it,
+ * and its slot is freed once the consumer returns. Messages the consumer
+ * pushes into this channel arm the node again, and are handled next time.
+ */
+template <typename T, unsigned int capacity>
+void TaskChannel<T, capacity>::callback(void* pointer)
+{
+    unsigned int waiting = count;
+    while(waiting-- != 0)
+    {
+        consumer(messages[first]);
+        first = (first + 1) % capacity;
+        count--;
+    }
+}
+
+#endif
@@ -25,6 +25,43 @@
  * THE SOFTWARE.
  */
 #include "Tasks.h"
+#if defined(__AVR__)
+#include <util/atomic.h>
+#endif
+
+/*
+ * Where the mailbox can't be lock-free (see TASKS_LOCK_FREE_MAILBOX), it
+ * is guarded by turning interrupts off, then back to however they were:
+ * post() may be called from code that has already turned them off. AVR
+ * uses ATOMIC_BLOCK(ATOMIC_RESTORESTATE) for this.
+ */
+#if !defined(TASKS_LOCK_FREE_MAILBOX) && !defined(__AVR__)
+static inline uint32_t disableInterrupts()
+{
+#if defined(__arm__)
+    uint32_t primask;
+    __asm__ volatile("mrs %0, primask" : "=r"(primask));
+    __asm__ volatile("cpsid i" ::: "memory");
+    return primask;
+#elif defined(ESP8266)
+    return xt_rsil(15);
+#else // no way to read the state here; assume interrupts were on
+    noInterrupts();
+    return 0;
+#endif
+}
+
+static inline void restoreInterrupts(uint32_t state)
+{
+#if defined(__arm__)
+    __asm__ volatile("msr primask, %0" : : "r"(state) : "memory");
+#elif defined(ESP8266)
+    xt_wsr_ps(state);
+#else
+    interrupts();
+#endif
+}
+#endif
 
 /*
  * dispatch() - calls tasks when it is time, and any stored loop function/method.
@@ -35,16 +72,37 @@
  */
 boolean Tasks::dispatch()
 {
+    // Add any tasks posted from other threads to the list.
+    if(hasPosted())
+    {
+        mergePosted();
+    }
+
+    // Check if a static task is ready to be called and due no later than the first scheduled task.
+    if(staticCount != 0)
+    {
+        unsigned long deadline = staticDeadlines[staticNext];
+        if(((long)(timer0_millis - deadline) >= 0) && ((head == NULL) || ((long)(head->timeout - deadline) >= 0)))
+        {
+            // copy the entry out of flash, and set its next deadline before calling it,
+            // in case the callback replaces the static schedule
+            StaticTask task;
+            memcpy_P(&task, &staticTable[staticNext], sizeof(StaticTask));
+            staticDeadlines[staticNext] = deadline + task.period;
+            findStaticNext();
+            task.callback();
+            return true; // callback was called
+        }
+    }
+
     // Check if a task is ready to be called. If so, call it and return after it exits.
     if((head != NULL) && ((long)(timer0_millis - head->timeout) >= 0))
     {
         // remove from list now, in case the callback modifies list by calling schedule()
         ScheduledTask* timeout = head;
         head = timeout->next;
-        // call it
-        timeout->call();
-        // delete it.
-        delete timeout;
+        // call it, then delete it (or give it back to whoever owns it).
+        timeout->run();
         return true; // callback was called
     }
 
@@ -82,172 +140,55 @@ boolean Tasks::dispatch()
  */
 bool Tasks::schedule(Callback callback, unsigned long delay)
 {
-    Task* callbackInstance = new Task(callback, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay));
 }
 bool Tasks::schedule(CallbackTakesBool callback, unsigned long delay, bool value)
 {
-    TaskTakesBool* callbackInstance = new TaskTakesBool(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesFloat callback, unsigned long delay, float value)
 {
-    TaskTakesFloat* callbackInstance = new TaskTakesFloat(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesDouble callback, unsigned long delay, double value)
 {
-    TaskTakesDouble* callbackInstance = new TaskTakesDouble(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesCharPointer callback, unsigned long delay, char* value)
 {
-    TaskTakesCharPointer* callbackInstance = new TaskTakesCharPointer(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesString callback, unsigned long delay, String value)
 {
-    TaskTakesString* callbackInstance = new TaskTakesString(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesChar callback, unsigned long delay, char value)
 {
-    TaskTakesChar* callbackInstance = new TaskTakesChar(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesUnsignedChar callback, unsigned long delay, unsigned char value)
 {
-    TaskTakesUnsignedChar* callbackInstance = new TaskTakesUnsignedChar(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesInt callback, unsigned long delay, int value)
 {
-    TaskTakesInt* callbackInstance = new TaskTakesInt(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesUnsignedInt callback, unsigned long delay, unsigned int value)
 {
-    TaskTakesUnsignedInt* callbackInstance = new TaskTakesUnsignedInt(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesLong callback, unsigned long delay, long value)
 {
-    TaskTakesLong* callbackInstance = new TaskTakesLong(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesUnsignedLong callback, unsigned long delay, unsigned long value)
 {
-    TaskTakesUnsignedLong* callbackInstance = new TaskTakesUnsignedLong(callback, value, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, value));
 }
 bool Tasks::schedule(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer)
 {
-    TaskTakesVoidPointer* callbackInstance = new TaskTakesVoidPointer(callback, pointer, delay);
-    if(callbackInstance == NULL) // out of memory?
-    {
-        return false;
-    }
-    else // successfully created Callback subclass instance; now create ScheduledTask
-    {
-        schedule(callbackInstance);
-        return true;
-    }
+    return add(newTask(callback, delay, pointer));
 }
 
 /*************************************************************************
@@ -265,16 +206,153 @@ bool Tasks::schedule(CallbackTakesVoidPointer callback, unsigned long delay, voi
  */
 bool Tasks::schedule(Callable* listener, unsigned long delay, void* pointer)
 {
-    MethodTask* listenerCallback = new MethodTask(listener, pointer, delay);
-    if(listenerCallback == NULL) // out of memory?
+    return add(newTask(listener, delay, pointer));
+}
+
+/*
+ * scheduleBatch(descriptors, count) - schedules many functions at once
+ *
+ * Creates a task for each of the count descriptors, all in a single
+ * allocation, sorts them by when they should run, and merges them into
+ * the list of pending tasks in one pass. This is much faster than calling
+ * schedule() for each one when there are many tasks to add, because
+ * schedule() walks the list of pending tasks every time it is called.
+ *
+ * Tasks that are due at the same time are called in the order they were
+ * added, just as if schedule() had been called for each descriptor in turn.
+ * Returns false, and schedules nothing, if memory cannot be allocated.
+ */
+bool Tasks::scheduleBatch(const TaskDescriptor* descriptors, unsigned int count)
+{
+    if(count == 0)
+    {
+        return true;
+    }
+    TaskBatch* batch = new TaskBatch;
+    if(batch == NULL) // out of memory?
     {
         return false;
     }
-    else
+    batch->tasks = new BatchTask[count];
+    if(batch->tasks == NULL) // out of memory?
+    {
+        delete batch;
+        return false;
+    }
+    batch->pending = count;
+
+    // fill in the tasks, linked in the order they were described
+    unsigned long now = timer0_millis;
+    for(unsigned int i = 0; i < count; i++)
     {
-        schedule(listenerCallback);
+        BatchTask* task = &batch->tasks[i];
+        task->callback = descriptors[i].callback;
+        task->pointer = descriptors[i].pointer;
+        task->batch = batch;
+        task->timeout = now + descriptors[i].delay;
+        task->next = (i + 1 < count) ? &batch->tasks[i + 1] : NULL;
+    }
+
+    // pending tasks go ahead of new ones that are due at the same time
+    head = merge(head, sort(batch->tasks));
+    return true;
+}
+
+/*
+ * arm(node, delay) - schedules a TaskNode owned by the sketch
+ *
+ * Like schedule(), but nothing is allocated: the node itself is linked
+ * into the list of pending tasks. If the node is already armed, in this
+ * or another Tasks, it is moved so that it is called after the new delay.
+ */
+bool Tasks::arm(TaskNode* node, unsigned long delay)
+{
+    if(node->owner != NULL) // already armed? take it out of that list first
+    {
+        node->owner->unlink(node);
+    }
+    node->next = NULL; // may still point into the list it was last called from
+    node->timeout = timer0_millis + delay;
+    node->owner = this;
+    schedule(node);
+    return true;
+}
+
+/*
+ * disarm(node) - removes a TaskNode from the list of pending tasks
+ *
+ * Returns false if the node was not armed in this Tasks.
+ */
+bool Tasks::disarm(TaskNode* node)
+{
+    if(node->owner != this)
+    {
+        return false;
+    }
+    unlink(node);
+    node->owner = NULL;
+    return true;
+}
+
+/*
+ * nextTimeout(timeout) - finds out when the next task is due
+ *
+ * Stores the time (in timer0_millis) at which dispatch() will next call a
+ * task in timeout, and returns true; or returns false if nothing is pending.
+ * Lets a sketch (or an event loop) sleep until then instead of calling
+ * dispatch() over and over. Tasks posted from other threads are due now.
+ */
+bool Tasks::nextTimeout(unsigned long* timeout)
+{
+    if(hasPosted())
+    {
+        *timeout = timer0_millis;
         return true;
     }
+    bool found = false;
+    if(head != NULL)
+    {
+        *timeout = head->timeout;
+        found = true;
+    }
+    if(staticCount != 0)
+    {
+        unsigned long deadline = staticDeadlines[staticNext];
+        if(!found || ((long)(*timeout - deadline) > 0))
+        {
+            *timeout = deadline;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/*
+ * setPayloadArena(size) - sets aside size bytes for tasks with payloads
+ *
+ * Tasks scheduled with a payload, and their payloads, are stored in this
+ * memory instead of on the heap. It is allocated once, here, and freed
+ * when the Tasks is destroyed. Each task takes the size of its payload
+ * plus about a dozen bytes. The arena is created by the first call, so a
+ * Tasks that never uses payloads holds just a pointer for it. Returns
+ * false if the memory can't be allocated, or if tasks with payloads are
+ * still pending.
+ */
+bool Tasks::setPayloadArena(unsigned int size)
+{
+    if(payloads == NULL)
+    {
+        if(size == 0)
+        {
+            return true;
+        }
+        payloads = new PayloadArena;
+        if(payloads == NULL) // out of memory?
+        {
+            return false;
+        }
+    }
+    return payloads->begin(size);
 }
 
 /*
@@ -297,6 +375,38 @@ boolean Tasks::setLoopMethodInstance(Loopable* loopingClassInstance)
     loopTask = NULL;
 }
 
+/*
+ * setStaticSchedule - replaces the current static schedule with the provided table.
+ *
+ * The table is read from flash (PROGMEM) and is never copied into RAM. The caller
+ * also provides an array with one unsigned long per table entry, in which the next
+ * deadline of each entry is kept. Both must remain valid while they are installed.
+ * Passing a count of zero removes the static schedule.
+ *
+ * Normally a sketch passes the table and deadlines array declared by
+ * TASKS_STATIC_SCHEDULE(), and the template version of this method fills in count.
+ * We only support one static schedule per Task.
+ */
+bool Tasks::setStaticSchedule(const StaticTask* table, unsigned long* deadlines, byte count)
+{
+    if((count != 0) && ((table == NULL) || (deadlines == NULL)))
+    {
+        return false;
+    }
+    unsigned long now = timer0_millis;
+    for(byte i = 0; i < count; i++)
+    {
+        unsigned long offset;
+        memcpy_P(&offset, &table[i].offset, sizeof(offset));
+        deadlines[i] = now + offset;
+    }
+    staticTable = table;
+    staticDeadlines = deadlines;
+    staticCount = count;
+    findStaticNext();
+    return true;
+}
+
 
 /***********************************************
  * METHODS THAT SKETCHES WILL *NOT* USE        *
@@ -369,6 +479,225 @@ void MethodTask::call()
 {
     listener->callback(pointer);
 }
+void BatchTask::call()
+{
+    callback(pointer);
+}
+void TaskNode::call()
+{
+    listener->callback(pointer);
+}
+void PipelineStage::call()
+{
+    if(function != NULL)
+    {
+        function();
+    }
+    else
+    {
+        TaskNode::call();
+    }
+}
+
+/*
+ * isArmed - true if the node is waiting in a Tasks list to be called
+ */
+bool TaskNode::isArmed()
+{
+    return owner != NULL;
+}
+
+/*
+ * run - called by dispatch() once a task has been removed from the list
+ *
+ * A TaskNode is disarmed before it is called, so that its callback
+ * can arm it again. Tasks does not release it afterwards because it
+ * does not own it.
+ */
+void ScheduledTask::run()
+{
+    call();
+    release();
+}
+void TaskNode::run()
+{
+    owner = NULL;
+    call();
+}
+
+/*
+ * run - calls a pipeline stage, then releases the stages that follow it
+ *
+ * A stage is released at the latest of the times its incoming edges allow
+ * (the time the stage at the other end was called, plus the edge's delay),
+ * whatever order those edges were declared in. Stages whose release time
+ * has already come are not put back in the list; they are collected in a
+ * queue of ready stages, linked by readyNext, and called here before
+ * dispatch() returns. The others are armed in the Tasks that called this
+ * stage, to be called at their release time.
+ */
+void PipelineStage::run()
+{
+    Tasks* tasks = owner;
+    owner = NULL;
+
+    PipelineStage* ready = this; // first stage in the queue of ready stages
+    PipelineStage* last = this;  // last stage in that queue
+    readyNext = NULL;
+    while(ready != NULL)
+    {
+        PipelineStage* stage = ready;
+        ready = stage->readyNext;
+        if(ready == NULL)
+        {
+            last = NULL;
+        }
+
+        unsigned long calledAt = timer0_millis;
+        stage->waiting = stage->predecessors; // ready for the next run of the pipeline
+        stage->call();
+
+        for(PipelineEdge* edge = stage->edges; edge != NULL; edge = edge->nextEdge)
+        {
+            PipelineStage* successor = edge->to;
+            unsigned long releaseTime = calledAt + edge->delay;
+            if((successor->waiting == successor->predecessors) || // first edge counted this run?
+               ((long)(releaseTime - successor->releaseTime) > 0))
+            {
+                successor->releaseTime = releaseTime;
+            }
+            if(--successor->waiting != 0) // still waiting for other stages?
+            {
+                continue;
+            }
+            long remaining = (long)(successor->releaseTime - timer0_millis);
+            if(remaining > 0)
+            {
+                tasks->arm(successor, remaining);
+            }
+            else // call it in this dispatch(), after the stages already ready
+            {
+                if(successor->owner != NULL) // armed some other way? it runs now instead
+                {
+                    successor->owner->disarm(successor);
+                }
+                successor->readyNext = NULL;
+                if(last == NULL)
+                {
+                    ready = successor;
+                }
+                else
+                {
+                    last->readyNext = successor;
+                }
+                last = successor;
+            }
+        }
+    }
+}
+
+/*
+ * release - called when Tasks no longer needs a task
+ *
+ * Ordinary tasks are deleted. A task from a batch is part of an array
+ * that can only be freed once every task in it has been released.
+ */
+void ScheduledTask::release()
+{
+    delete this;
+}
+void TaskNode::release()
+{
+    owner = NULL; // the node belongs to the sketch; just forget it
+}
+void BatchTask::release()
+{
+    TaskBatch* owner = batch;
+    if(--owner->pending == 0)
+    {
+        delete[] owner->tasks; // including this one
+        delete owner;
+    }
+}
+
+/*
+ * newTask - creates the task that schedule() or post() adds for a callback
+ *
+ * Returns NULL if there is not enough memory.
+ */
+ScheduledTask* Tasks::newTask(Callback callback, unsigned long delay)
+{
+    return new Task(callback, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesBool callback, unsigned long delay, bool value)
+{
+    return new TaskTakesBool(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesFloat callback, unsigned long delay, float value)
+{
+    return new TaskTakesFloat(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesDouble callback, unsigned long delay, double value)
+{
+    return new TaskTakesDouble(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesCharPointer callback, unsigned long delay, char* value)
+{
+    return new TaskTakesCharPointer(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesString callback, unsigned long delay, String value)
+{
+    return new TaskTakesString(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesChar callback, unsigned long delay, char value)
+{
+    return new TaskTakesChar(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesUnsignedChar callback, unsigned long delay, unsigned char value)
+{
+    return new TaskTakesUnsignedChar(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesInt callback, unsigned long delay, int value)
+{
+    return new TaskTakesInt(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesUnsignedInt callback, unsigned long delay, unsigned int value)
+{
+    return new TaskTakesUnsignedInt(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesLong callback, unsigned long delay, long value)
+{
+    return new TaskTakesLong(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesUnsignedLong callback, unsigned long delay, unsigned long value)
+{
+    return new TaskTakesUnsignedLong(callback, value, delay);
+}
+ScheduledTask* Tasks::newTask(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer)
+{
+    return new TaskTakesVoidPointer(callback, pointer, delay);
+}
+ScheduledTask* Tasks::newTask(Callable* listener, unsigned long delay, void* pointer)
+{
+    return new MethodTask(listener, pointer, delay);
+}
+
+/*
+ * add - adds a task created by newTask() to the list of timeouts
+ *
+ * Turns the task's delay into the time at which it is due.
+ * Returns false if the task could not be created.
+ */
+bool Tasks::add(ScheduledTask* timeout)
+{
+    if(timeout == NULL) // out of memory?
+    {
+        return false;
+    }
+    timeout->timeout += timer0_millis;
+    schedule(timeout);
+    return true;
+}
 
 /*
  * set - places a timeout in the list of timeouts, sorted by when the timeout will occur (soonest to latest)
@@ -417,72 +746,392 @@ void Tasks::schedule(ScheduledTask* timeout)
     }
 }
 
+/*
+ * findStaticNext - finds the static schedule entry whose deadline comes first.
+ *
+ * Static schedules are small, so a scan here (once per static task called)
+ * keeps dispatch() down to a single comparison when nothing is ready.
+ */
+void Tasks::findStaticNext()
+{
+    staticNext = 0;
+    for(byte i = 1; i < staticCount; i++)
+    {
+        if((long)(staticDeadlines[staticNext] - staticDeadlines[i]) > 0)
+        {
+            staticNext = i;
+        }
+    }
+}
+
+/*
+ * postTask - adds a task to the mailbox of tasks posted from other threads
+ *
+ * The mailbox is a stack that any number of threads push onto, and that
+ * only dispatch() empties, all at once. So pushing needs no lock: just
+ * retry if another thread pushed first. Without compare-and-swap, interrupts
+ * are turned off while the task is pushed instead.
+ */
+void Tasks::postTask(ScheduledTask* timeout)
+{
+#if defined(TASKS_LOCK_FREE_MAILBOX)
+    ScheduledTask* first = __atomic_load_n(&inbox, __ATOMIC_RELAXED);
+    do
+    {
+        timeout->next = first;
+    }
+    while(!__atomic_compare_exchange_n(&inbox, &first, timeout, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#elif defined(__AVR__)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        timeout->next = inbox;
+        inbox = timeout;
+    }
+#else
+    uint32_t state = disableInterrupts();
+    timeout->next = inbox;
+    inbox = timeout;
+    restoreInterrupts(state);
+#endif
+}
+
+/*
+ * hasPosted - true if there are tasks in the mailbox
+ */
+bool Tasks::hasPosted()
+{
+#if defined(TASKS_LOCK_FREE_MAILBOX)
+    return __atomic_load_n(&inbox, __ATOMIC_RELAXED) != NULL;
+#else
+    return inbox != NULL;
+#endif
+}
+
+/*
+ * mergePosted - moves every task in the mailbox to the list of timeouts
+ *
+ * Takes the whole mailbox at once, puts the tasks back in the order they
+ * were posted, and merges them into the list the way scheduleBatch() does.
+ * Posted tasks still hold their delay, which counts from now: only this
+ * thread reads timer0_millis, which may be updated by the dispatching one.
+ */
+void Tasks::mergePosted()
+{
+    ScheduledTask* posted;
+#if defined(TASKS_LOCK_FREE_MAILBOX)
+    posted = __atomic_exchange_n(&inbox, (ScheduledTask*) NULL, __ATOMIC_ACQUIRE);
+#elif defined(__AVR__)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        posted = inbox;
+        inbox = NULL;
+    }
+#else
+    uint32_t state = disableInterrupts();
+    posted = inbox;
+    inbox = NULL;
+    restoreInterrupts(state);
+#endif
+
+    unsigned long now = timer0_millis;
+    ScheduledTask* ordered = NULL; // oldest first
+    while(posted != NULL)
+    {
+        ScheduledTask* next = posted->next;
+        posted->timeout += now;
+        posted->next = ordered;
+        ordered = posted;
+        posted = next;
+    }
+    head = merge(head, sort(ordered));
+}
+
+/*
+ * PayloadArena - blocks of memory handed out around a ring
+ *
+ * Every block starts with a header, rounded up so that what follows
+ * is aligned for any type, and is a multiple of that alignment long.
+ */
+struct PayloadBlock
+{
+    unsigned int size; // including this header
+    bool released;
+};
+
+static unsigned int alignPayload(unsigned int size)
+{
+    return (size + PayloadArena::ALIGNMENT - 1) & ~(PayloadArena::ALIGNMENT - 1);
+}
+
+static const unsigned int PAYLOAD_HEADER = alignPayload(sizeof(PayloadBlock));
+
+PayloadArena::~PayloadArena()
+{
+    delete[] allocation;
+}
+
+/*
+ * begin - allocates the ring, replacing any earlier one
+ *
+ * new only promises alignment for the basic types, so a little more is
+ * allocated and the ring starts at the first address aligned to ALIGNMENT.
+ * A size of zero just frees the ring. Fails if blocks are still in use.
+ */
+bool PayloadArena::begin(unsigned int size)
+{
+    if(!isEmpty())
+    {
+        return false;
+    }
+    delete[] allocation;
+    allocation = NULL;
+    memory = NULL;
+    this->size = 0;
+    if(size == 0)
+    {
+        return true;
+    }
+    allocation = new byte[size + ALIGNMENT - 1];
+    if(allocation == NULL) // out of memory?
+    {
+        return false;
+    }
+    memory = allocation + (ALIGNMENT - (uintptr_t) allocation % ALIGNMENT) % ALIGNMENT;
+    this->size = size;
+    return true;
+}
+
+/*
+ * allocate - hands out the next block big enough for size bytes, or NULL if there is no room
+ *
+ * The blocks in use always form one run around the ring, from first to end.
+ * A new block goes at end if it fits before the top of the ring; if not,
+ * the ring wraps and the block goes at offset 0, if it fits before first.
+ */
+void* PayloadArena::allocate(unsigned int size)
+{
+    reclaim();
+    unsigned int needed = PAYLOAD_HEADER + alignPayload(size);
+    unsigned int at;
+    if(!wrapped && (needed <= this->size - end))
+    {
+        at = end;
+    }
+    else if(!wrapped && (needed <= first)) // no room at the top; start over at the bottom
+    {
+        wrapAt = end;
+        wrapped = true;
+        at = 0;
+    }
+    else if(wrapped && (needed <= first - end))
+    {
+        at = end;
+    }
+    else // full
+    {
+        return NULL;
+    }
+
+    PayloadBlock* block = (PayloadBlock*) &memory[at];
+    block->size = needed;
+    block->released = false;
+    end = at + needed;
+    count++;
+    return &memory[at + PAYLOAD_HEADER];
+}
+
+/*
+ * release - marks a block handed out by allocate() as no longer needed
+ *
+ * Its memory is reused once every block handed out before it is released.
+ */
+void PayloadArena::release(void* block)
+{
+    ((PayloadBlock*)((byte*) block - PAYLOAD_HEADER))->released = true;
+}
+
+bool PayloadArena::isEmpty()
+{
+    reclaim();
+    return count == 0;
+}
+
+/*
+ * reclaim - frees the oldest blocks, as long as they have been released
+ */
+void PayloadArena::reclaim()
+{
+    while(count != 0)
+    {
+        PayloadBlock* block = (PayloadBlock*) &memory[first];
+        if(!block->released)
+        {
+            break;
+        }
+        first += block->size;
+        count--;
+        if(wrapped && (first == wrapAt)) // reached the top: continue at the bottom
+        {
+            first = 0;
+            wrapped = false;
+        }
+    }
+    if(count == 0) // nothing in use: start again from the bottom
+    {
+        first = 0;
+        end = 0;
+        wrapped = false;
+    }
+}
+
+/*
+ * unlink - removes a task from the list of timeouts without calling or releasing it
+ *
+ * Returns false if the task was not in the list.
+ */
+bool Tasks::unlink(ScheduledTask* timeout)
+{
+    ScheduledTask** link = &head; // the pointer that points to current
+    while(*link != NULL)
+    {
+        if(*link == timeout)
+        {
+            *link = timeout->next;
+            timeout->next = NULL;
+            return true;
+        }
+        link = &(*link)->next;
+    }
+    return false;
+}
+
+/*
+ * sort - sorts a list of tasks by timeout, soonest first
+ *
+ * A merge sort, so that sorting m tasks takes time proportional to m log m.
+ * Tasks with the same timeout stay in the order they were in.
+ */
+ScheduledTask* Tasks::sort(ScheduledTask* list)
+{
+    if((list == NULL) || (list->next == NULL)) // nothing to sort?
+    {
+        return list;
+    }
+
+    // find the middle of the list, and split it there
+    ScheduledTask* middle = list;
+    ScheduledTask* end = list->next;
+    while((end != NULL) && (end->next != NULL))
+    {
+        middle = middle->next;
+        end = end->next->next;
+    }
+    ScheduledTask* second = middle->next;
+    middle->next = NULL;
+
+    return merge(sort(list), sort(second));
+}
+
+/*
+ * merge - combines two sorted lists of tasks into one sorted list
+ *
+ * If tasks from both lists have the same timeout, those from the first
+ * list are placed ahead of those from the second.
+ */
+ScheduledTask* Tasks::merge(ScheduledTask* first, ScheduledTask* second)
+{
+    ScheduledTask* merged = NULL;
+    ScheduledTask** last = &merged; // where to link the next task
+    while((first != NULL) && (second != NULL))
+    {
+        if((long)(first->timeout - second->timeout) > 0) // if second's task occurs first
+        {
+            *last = second;
+            second = second->next;
+        }
+        else
+        {
+            *last = first;
+            first = first->next;
+        }
+        last = &(*last)->next;
+    }
+    *last = (first != NULL) ? first : second; // append whatever remains
+    return merged;
+}
+
 /*
  * Deletes any objects stored in the list of delayed functions/methods.
  */
 Tasks::~Tasks()
 {
+    if(hasPosted())
+    {
+        mergePosted();
+    }
     ScheduledTask* timeout = head;
     while(timeout != NULL)
     {
         ScheduledTask* discarded = timeout;
         timeout = timeout->next;
-        delete discarded;
+        discarded->release();
     }
+    delete payloads; // after the tasks in it have been released
 }
 
 /*
  * Creates a task from the provided callback and delay
  * (and stores the parameter to call the task, if any).
- * Converts the delay time into an absolute time value
- * by adding the delay time to the current time (millis()).
+ * The delay is kept in timeout until the task is added
+ * to a Tasks, which adds the current time (millis()) then,
+ * so a task posted from another thread never reads the clock.
  */
 Task::Task(Callback callback, unsigned long delay)
     : callback(callback)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesBool::TaskTakesBool(CallbackTakesBool callback, bool value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesFloat::TaskTakesFloat(CallbackTakesFloat callback, float value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesDouble::TaskTakesDouble(CallbackTakesDouble callback, double value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesCharPointer::TaskTakesCharPointer(CallbackTakesCharPointer callback, char* value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesString::TaskTakesString(CallbackTakesString callback, String value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesChar::TaskTakesChar(CallbackTakesChar callback, char value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesUnsignedChar::TaskTakesUnsignedChar(CallbackTakesUnsignedChar callback,
@@ -491,28 +1140,28 @@ TaskTakesUnsignedChar::TaskTakesUnsignedChar(CallbackTakesUnsignedChar callback,
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesInt::TaskTakesInt(CallbackTakesInt callback, int value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesUnsignedInt::TaskTakesUnsignedInt(CallbackTakesUnsignedInt callback, unsigned int value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesLong::TaskTakesLong(CallbackTakesLong callback, long value, unsigned long delay)
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesUnsignedLong::TaskTakesUnsignedLong(CallbackTakesUnsignedLong callback,
@@ -521,19 +1170,79 @@ TaskTakesUnsignedLong::TaskTakesUnsignedLong(CallbackTakesUnsignedLong callback,
     : callback(callback)
     , value(value)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 TaskTakesVoidPointer::TaskTakesVoidPointer(CallbackTakesVoidPointer callback, void* pointer, unsigned long delay)
     : callback(callback)
     , pointer(pointer)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
 };
 
 MethodTask::MethodTask(Callable* listener, void* pointer, unsigned long delay)
     : listener(listener)
     , pointer(pointer)
 {
-    timeout = timer0_millis + delay;
+    timeout = delay;
+}
+
+/*
+ * A TaskNode has no timeout until it is armed.
+ */
+TaskNode::TaskNode(Callable* listener, void* pointer)
+    : listener(listener)
+    , pointer(pointer)
+{
+}
+
+/*
+ * Copies only what the node calls back; the copy is not armed.
+ */
+TaskNode::TaskNode(const TaskNode& other)
+    : listener(other.listener)
+    , pointer(other.pointer)
+{
+}
+
+/*
+ * Takes the node out of the list it is armed in, so that Tasks is not
+ * left pointing at it.
+ */
+TaskNode::~TaskNode()
+{
+    if(owner != NULL)
+    {
+        owner->disarm(this);
+    }
+}
+
+PipelineStage::PipelineStage(Callback function)
+    : TaskNode(NULL)
+    , function(function)
+{
+}
+
+PipelineStage::PipelineStage(Callable* listener, void* pointer)
+    : TaskNode(listener, pointer)
+{
+}
+
+/*
+ * Adds the edge to the end of the edges leaving from, so that the stages
+ * that follow a stage are released in the order their edges were declared,
+ * and counts from among the stages that to depends on.
+ */
+PipelineEdge::PipelineEdge(PipelineStage* from, PipelineStage* to, unsigned long delay)
+    : to(to)
+    , delay(delay)
+{
+    PipelineEdge** link = &from->edges;
+    while(*link != NULL)
+    {
+        link = &(*link)->nextEdge;
+    }
+    *link = this;
+    to->predecessors++;
+    to->waiting++;
 }
@@ -89,6 +89,18 @@
 // Update this whenever releasing a new version of the library to Github
 const static char* TASKS_LIBRARY_VERSION = "0.0.4";
 
+/*
+ * The mailbox of posted tasks is lock-free where the processor can
+ * compare-and-swap a pointer itself. Elsewhere (e.g. AVR, or ARMv6-M as
+ * on the SAMD21 and RP2040), GCC would turn the atomic builtins into calls
+ * to library functions that most Arduino cores don't provide, so interrupts
+ * are turned off for a moment instead. That is only enough on one core,
+ * so ShardedTasks is not available there.
+ */
+#if defined(__GCC_ATOMIC_POINTER_LOCK_FREE) && (__GCC_ATOMIC_POINTER_LOCK_FREE == 2)
+#define TASKS_LOCK_FREE_MAILBOX
+#endif
+
 /*
  * Used in place of millis() to reduce execution time.
  */
@@ -119,18 +131,107 @@ public:
  * 
  * Each ScheduledTask also holds the time it should be
  * executed (timeout).
+ * 
+ * When a ScheduledTask is due, dispatch() calls its run() method,
+ * which calls call() and then release(). Once Tasks is done with a
+ * ScheduledTask, because it was called or because it was discarded,
+ * release() is called. By default release() deletes the task;
+ * subclasses whose memory is managed some other way override it.
+ * The tasks schedule() creates override run() to do both without
+ * any further virtual calls (see HeapTask).
  */
 class ScheduledTask
 {
 public:
-    virtual void call();
+    virtual ~ScheduledTask() {}
+    virtual void call() = 0;
 
 protected:
+    virtual void run();
+    virtual void release();
     ScheduledTask* next = NULL;
     unsigned long timeout;
     friend class Tasks;
 };
 
+/*
+ * One entry of a static schedule: a function that is called every
+ * period milliseconds, the first time offset milliseconds after the
+ * schedule is installed using setStaticSchedule().
+ *
+ * A table of StaticTasks is fixed when the sketch is compiled, so it
+ * can be stored in flash (PROGMEM) instead of RAM. Only the next
+ * deadline of each entry is kept in RAM. See TASKS_STATIC_SCHEDULE().
+ */
+struct StaticTask
+{
+    Callback callback;
+    unsigned long period;
+    unsigned long offset;
+};
+
+/*
+ * Describes one task to be added by scheduleBatch(): the function
+ * to call, the delay in milliseconds, and the pointer to pass to it.
+ */
+struct TaskDescriptor
+{
+    CallbackTakesVoidPointer callback;
+    unsigned long delay;
+    void* pointer;
+};
+
+/*
+ * A ring buffer of memory for tasks that carry a payload
+ *
+ * Each block holds one task and its payload, after a small header. Blocks
+ * are handed out in order around the ring; when a task has been called,
+ * its block is marked released, and released blocks are reused in the
+ * order they were handed out (FIFO), once every block before them has been
+ * released too. The memory is allocated once, by begin(), and what
+ * follows each header is aligned to ALIGNMENT bytes.
+ */
+class PayloadArena
+{
+public:
+    static const unsigned int ALIGNMENT = __BIGGEST_ALIGNMENT__;
+
+    ~PayloadArena();
+    bool begin(unsigned int size);
+    void* allocate(unsigned int size);
+    static void release(void* block);
+    bool isEmpty();
+
+private:
+    byte* allocation = NULL; // as returned by new, which may not be aligned
+    byte* memory = NULL;     // the ring, within allocation, aligned
+    unsigned int size = 0;
+    unsigned int first = 0;    // offset of the oldest block
+    unsigned int end = 0;      // offset just past the newest block
+    unsigned int wrapAt = 0;   // end of the blocks at the top of the ring, once wrapped
+    bool wrapped = false;      // true if newer blocks start over at offset 0
+    unsigned int count = 0;    // blocks not yet reused
+    void reclaim();
+};
+
+/*
+ * Declares a static schedule table called name, stored in flash, and the
+ * RAM array name##Deadlines that holds the next deadline of each entry:
+ *
+ *   TASKS_STATIC_SCHEDULE(sensors,
+ *       {readSensors, 50},         // every 50 ms, starting now
+ *       {report, 5000, 10});       // every 5 s, starting in 10 ms
+ *   ...
+ *   tasks.setStaticSchedule(sensors, sensorsDeadlines);
+ */
+#define TASKS_STATIC_SCHEDULE(name, ...) \
+    const StaticTask name[] PROGMEM = {__VA_ARGS__}; \
+    unsigned long name##Deadlines[sizeof(name) / sizeof(StaticTask)]
+
+class TaskNode;
+template <typename T>
+class PayloadTask;
+
 /*
  * Holds scheduled tasks and the loop method to be called.
  * Provides methods for scheduling callbacks with different
@@ -141,8 +242,43 @@ class Tasks
 private:
     ScheduledTask* head = NULL;
     void schedule(ScheduledTask* timeout);
+    bool unlink(ScheduledTask* timeout);
     Callback loopTask = NULL;
     Loopable* loopInstance = NULL;
+    const StaticTask* staticTable = NULL; // in flash
+    unsigned long* staticDeadlines = NULL; // in RAM, one per staticTable entry
+    byte staticCount = 0;
+    byte staticNext = 0; // index of the entry with the earliest deadline
+    void findStaticNext();
+    static ScheduledTask* sort(ScheduledTask* list);
+    static ScheduledTask* merge(ScheduledTask* first, ScheduledTask* second);
+    ScheduledTask* volatile inbox = NULL; // tasks posted by other threads, most recent first
+    void postTask(ScheduledTask* timeout);
+    bool hasPosted();
+    void mergePosted();
+    PayloadArena* payloads = NULL; // created by setPayloadArena()
+    bool add(ScheduledTask* timeout);
+    static ScheduledTask* newTask(Callback callback, unsigned long delay);
+    static ScheduledTask* newTask(CallbackTakesBool callback, unsigned long delay, bool value);
+    static ScheduledTask* newTask(CallbackTakesFloat callback, unsigned long delay, float value);
+    static ScheduledTask* newTask(CallbackTakesDouble callback, unsigned long delay, double value);
+    static ScheduledTask* newTask(CallbackTakesCharPointer callback, unsigned long delay, char* value);
+    static ScheduledTask* newTask(CallbackTakesString callback, unsigned long delay, String value);
+    static ScheduledTask* newTask(CallbackTakesChar callback, unsigned long delay, char value);
+    static ScheduledTask* newTask(CallbackTakesUnsignedChar callback, unsigned long delay, unsigned char value);
+    static ScheduledTask* newTask(CallbackTakesInt callback, unsigned long delay, int value);
+    static ScheduledTask* newTask(CallbackTakesUnsignedInt callback, unsigned long delay, unsigned int value);
+    static ScheduledTask* newTask(CallbackTakesLong callback, unsigned long delay, long value);
+    static ScheduledTask* newTask(CallbackTakesUnsignedLong callback, unsigned long delay, unsigned long value);
+    static ScheduledTask* newTask(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer);
+    static ScheduledTask* newTask(Callable* listener, unsigned long delay, void* pointer = NULL);
+    template <typename T>
+    static ScheduledTask* newTask(void (*callback)(const T&), unsigned long delay, const T& payload)
+    {
+        static_assert(sizeof(T) == 0, "tasks with payloads can't be posted: they live in the payload arena of "
+                                      "the Tasks that schedules them, which only its own thread may use");
+        return NULL;
+    }
 
 public:
     ~Tasks();
@@ -150,6 +286,13 @@ public:
 
     bool setLoopFunction(Callback loopTask);
     bool setLoopMethodInstance(Loopable* loopInstance);
+    bool setStaticSchedule(const StaticTask* table, unsigned long* deadlines, byte count);
+    template <size_t count>
+    bool setStaticSchedule(const StaticTask (&table)[count], unsigned long (&deadlines)[count])
+    {
+        static_assert(count <= 255, "a static schedule can hold at most 255 tasks");
+        return setStaticSchedule(table, deadlines, (byte) count);
+    }
     bool schedule(Callback callback, unsigned long delay);
     bool schedule(CallbackTakesBool callback, unsigned long delay, bool value);
     bool schedule(CallbackTakesFloat callback, unsigned long delay, float value);
@@ -164,6 +307,92 @@ public:
     bool schedule(CallbackTakesUnsignedLong callback, unsigned long delay, unsigned long value);
     bool schedule(CallbackTakesVoidPointer callback, unsigned long delay, void* pointer);
     bool schedule(Callable* listener, unsigned long delay, void* pointer = NULL);
+    bool scheduleBatch(const TaskDescriptor* descriptors, unsigned int count);
+    bool arm(TaskNode* node, unsigned long delay);
+    bool disarm(TaskNode* node);
+    bool nextTimeout(unsigned long* timeout);
+    bool setPayloadArena(unsigned int size);
+
+    /*
+     * schedule(callback, delay, payload) - calls callback with a copy of payload
+     *
+     * Takes a struct (or any type that can be copied byte for byte) of
+     * any size. The task and the copy of the payload are placed in the
+     * payload arena, so nothing is allocated on the heap; the callback
+     * gets a reference to the copy in the arena. Returns false if there
+     * is no room in the arena, or no arena (see setPayloadArena()).
+     */
+    template <typename T>
+    bool schedule(void (*callback)(const T&), unsigned long delay, const T& payload)
+    {
+        static_assert(__is_trivially_copyable(T), "payloads must be trivially copyable");
+        static_assert(alignof(PayloadTask<T>) <= PayloadArena::ALIGNMENT,
+                      "payloads can't need more alignment than the payload arena gives");
+        if(payloads == NULL) // no arena?
+        {
+            return false;
+        }
+        void* block = payloads->allocate(sizeof(PayloadTask<T>));
+        if(block == NULL) // arena full?
+        {
+            return false;
+        }
+        return add(new(block) PayloadTask<T>(callback, payload, delay));
+    }
+
+    /*
+     * post - like schedule(), but safe to call from another thread or core
+     *
+     * Takes the same parameters as schedule(), except that tasks with a
+     * payload can't be posted (that doesn't compile). The task is created
+     * by the caller and added to this instance's mailbox without taking a
+     * lock; it joins the list of pending tasks the next time dispatch() is
+     * called, and its delay counts from then. The posting thread never
+     * reads timer0_millis, so another thread may keep that up to date.
+     */
+    template <typename CallbackType, typename... Parameter>
+    bool post(CallbackType callback, unsigned long delay, Parameter... value)
+    {
+        ScheduledTask* timeout = newTask(callback, delay, value...);
+        if(timeout == NULL) // out of memory?
+        {
+            return false;
+        }
+        postTask(timeout);
+        return true;
+    }
+};
+
+/*
+ * One Tasks instance per core (or thread), each of which can post tasks to the others
+ *
+ * Each shard is an ordinary Tasks that is dispatched only by the core that owns
+ * it: shard(n).dispatch(). Any core can add a task to any shard using
+ * schedule(onShard, ...), which goes through the shard's lock-free mailbox
+ * so no core ever waits for another.
+ */
+template <byte count>
+class ShardedTasks
+{
+#if !defined(TASKS_LOCK_FREE_MAILBOX)
+    // count != count is always false, but is only checked if ShardedTasks is used
+    static_assert(count != count, "ShardedTasks needs a processor that can compare-and-swap a pointer; "
+                                  "without it, the mailboxes are not safe between cores");
+#endif
+
+public:
+    Tasks& shard(byte index)
+    {
+        return shards[index];
+    }
+    template <typename CallbackType, typename... Parameter>
+    bool schedule(byte onShard, CallbackType callback, unsigned long delay, Parameter... value)
+    {
+        return shards[onShard].post(callback, delay, value...);
+    }
+
+private:
+    Tasks shards[count];
 };
 
 //
@@ -177,10 +406,31 @@ public:
 //
 // The constructor sets up the task by accepting the function to be
 // called back, the delay time, and any parameter to be passed. The
-// converts the delay time to the time in millis() at which the task
-// should be executed.
+// delay is kept until Tasks adds the task to its list, and converts
+// it to the time in millis() at which the task should be executed.
 //
-class Task : public ScheduledTask
+
+/*
+ * The base of the tasks that schedule() creates on the heap
+ *
+ * Because each of those classes is final, run() calls the task's call()
+ * and deletes it directly rather than through the virtual call(),
+ * release() and destructor, so dispatch() makes one virtual call per
+ * task, as it did before tasks could be owned by anything but Tasks.
+ */
+template <typename Derived>
+class HeapTask : public ScheduledTask
+{
+protected:
+    void run()
+    {
+        Derived* task = static_cast<Derived*>(this);
+        task->call();
+        delete task;
+    }
+};
+
+class Task final : public HeapTask<Task>
 {
 public:
     Task(Callback callback, unsigned long delay);
@@ -190,7 +440,7 @@ private:
     Callback callback;
 };
 
-class TaskTakesBool : public ScheduledTask
+class TaskTakesBool final : public HeapTask<TaskTakesBool>
 {
 public:
     TaskTakesBool(CallbackTakesBool callback, bool value, unsigned long delay);
@@ -201,7 +451,7 @@ private:
     bool value;
 };
 
-class TaskTakesFloat : public ScheduledTask
+class TaskTakesFloat final : public HeapTask<TaskTakesFloat>
 {
 public:
     TaskTakesFloat(CallbackTakesFloat callback, float value, unsigned long delay);
@@ -212,7 +462,7 @@ private:
     float value;
 };
 
-class TaskTakesDouble : public ScheduledTask
+class TaskTakesDouble final : public HeapTask<TaskTakesDouble>
 {
 public:
     TaskTakesDouble(CallbackTakesDouble callback, double value, unsigned long delay);
@@ -223,7 +473,7 @@ private:
     double value;
 };
 
-class TaskTakesCharPointer : public ScheduledTask
+class TaskTakesCharPointer final : public HeapTask<TaskTakesCharPointer>
 {
 public:
     TaskTakesCharPointer(CallbackTakesCharPointer callback, char* value, unsigned long delay);
@@ -234,7 +484,7 @@ private:
     char* value;
 };
 
-class TaskTakesString : public ScheduledTask
+class TaskTakesString final : public HeapTask<TaskTakesString>
 {
 public:
     TaskTakesString(CallbackTakesString callback, String value, unsigned long delay);
@@ -245,7 +495,7 @@ private:
     String value;
 };
 
-class TaskTakesChar : public ScheduledTask
+class TaskTakesChar final : public HeapTask<TaskTakesChar>
 {
 public:
     TaskTakesChar(CallbackTakesChar callback, char value, unsigned long delay);
@@ -256,7 +506,7 @@ private:
     char value;
 };
 
-class TaskTakesUnsignedChar : public ScheduledTask
+class TaskTakesUnsignedChar final : public HeapTask<TaskTakesUnsignedChar>
 {
 public:
     TaskTakesUnsignedChar(CallbackTakesUnsignedChar callback, unsigned char value, unsigned long delay);
@@ -267,7 +517,7 @@ private:
     unsigned char value;
 };
 
-class TaskTakesInt : public ScheduledTask
+class TaskTakesInt final : public HeapTask<TaskTakesInt>
 {
 public:
     TaskTakesInt(CallbackTakesInt callback, int value, unsigned long delay);
@@ -278,7 +528,7 @@ private:
     int value;
 };
 
-class TaskTakesUnsignedInt : public ScheduledTask
+class TaskTakesUnsignedInt final : public HeapTask<TaskTakesUnsignedInt>
 {
 public:
     TaskTakesUnsignedInt(CallbackTakesUnsignedInt callback, unsigned int value, unsigned long delay);
@@ -289,7 +539,7 @@ private:
     unsigned int value;
 };
 
-class TaskTakesLong : public ScheduledTask
+class TaskTakesLong final : public HeapTask<TaskTakesLong>
 {
 public:
     TaskTakesLong(CallbackTakesLong callback, long value, unsigned long delay);
@@ -300,7 +550,7 @@ private:
     long value;
 };
 
-class TaskTakesUnsignedLong : public ScheduledTask
+class TaskTakesUnsignedLong final : public HeapTask<TaskTakesUnsignedLong>
 {
 public:
     TaskTakesUnsignedLong(CallbackTakesUnsignedLong callback, unsigned long value, unsigned long delay);
@@ -311,7 +561,7 @@ private:
     unsigned long value;
 };
 
-class TaskTakesVoidPointer : public ScheduledTask
+class TaskTakesVoidPointer final : public HeapTask<TaskTakesVoidPointer>
 {
 public:
     TaskTakesVoidPointer(CallbackTakesVoidPointer callback, void* pointer, unsigned long delay);
@@ -322,6 +572,169 @@ private:
     void* pointer;
 };
 
+/*
+ * A ScheduledTask that belongs to the sketch instead of to Tasks
+ *
+ * A TaskNode is declared by the sketch, usually as a member of the
+ * object it calls back, and is armed and disarmed as often as needed
+ * using arm() and disarm(). Tasks only links it into and out of its
+ * list of pending tasks; it never allocates or deletes a TaskNode.
+ *
+ * When it is due, dispatch() calls the callback() method of the
+ * Callable passed to the constructor, with the pointer passed to the
+ * constructor. The node is no longer armed by then, so callback()
+ * can arm it again to be called periodically.
+ *
+ * A node that is destroyed while armed is disarmed first. A copy of a
+ * node calls back the same Callable, but is not armed.
+ */
+class TaskNode : public ScheduledTask
+{
+public:
+    TaskNode(Callable* listener, void* pointer = NULL);
+    TaskNode(const TaskNode& other);
+    TaskNode& operator=(const TaskNode& other) = delete;
+    ~TaskNode();
+    bool isArmed();
+    void call();
+
+protected:
+    void run();
+    void release();
+    Tasks* owner = NULL; // the Tasks this node is armed in, if any
+
+private:
+    Callable* listener;
+    void* pointer;
+    friend class Tasks;
+};
+
+/*
+ * A stage of a pipeline: a task that runs after the stages it depends on
+ *
+ * Stages are connected by PipelineEdges, each with its own delay, to form
+ * a chain or any other directed acyclic graph. A pipeline is started by
+ * arming its first stage (or stages) using Tasks::arm(). When a stage has
+ * been called, each stage that follows it is released once all of the
+ * stages it depends on have been called and the delay of every edge into
+ * it has passed, counted from the call of the stage at the other end; if
+ * that time has already come, it is called right away, in the same call
+ * to dispatch().
+ *
+ * Stages and edges are declared by the sketch and are never allocated
+ * or deleted by Tasks, so a pipeline can be run again and again by
+ * arming its first stage again once it has finished.
+ */
+class PipelineEdge;
+
+class PipelineStage : public TaskNode
+{
+public:
+    PipelineStage(Callback function);
+    PipelineStage(Callable* listener, void* pointer = NULL);
+    void call();
+
+protected:
+    void run();
+
+private:
+    Callback function = NULL;
+    PipelineEdge* edges = NULL; // the edges to the stages that follow this one
+    PipelineStage* readyNext = NULL; // the next stage to run in this dispatch()
+    byte predecessors = 0; // how many stages this one depends on
+    byte waiting = 0; // how many of those have not yet been called
+    unsigned long releaseTime = 0; // the latest time allowed by the edges counted so far
+    friend class PipelineEdge;
+};
+
+/*
+ * Makes the stage to depend on the stage from, so that to is released
+ * delay milliseconds after from has been called (and after every other
+ * stage it depends on has been called, too).
+ */
+class PipelineEdge
+{
+public:
+    PipelineEdge(PipelineStage* from, PipelineStage* to, unsigned long delay = 0);
+
+private:
+    PipelineStage* to;
+    unsigned long delay;
+    PipelineEdge* nextEdge = NULL; // the next edge leaving the same stage
+    friend class PipelineStage;
+};
+
+/*
+ * A ScheduledTask created by scheduleBatch()
+ *
+ * All the tasks of a batch are allocated together in one array, which
+ * is owned by a TaskBatch. Each task releases itself by counting down
+ * the batch's pending tasks, and the last one frees the whole batch.
+ */
+class TaskBatch;
+
+class BatchTask : public ScheduledTask
+{
+public:
+    void call();
+
+protected:
+    void release();
+
+private:
+    CallbackTakesVoidPointer callback;
+    void* pointer;
+    TaskBatch* batch;
+    friend class Tasks;
+};
+
+class TaskBatch
+{
+private:
+    BatchTask* tasks;
+    unsigned int pending;
+    friend class Tasks;
+    friend class BatchTask;
+};
+
+/*
+ * A ScheduledTask that carries a payload, created in a PayloadArena by
+ * Tasks::schedule(callback, delay, payload)
+ *
+ * The payload is stored in the task itself, so the callback is passed
+ * a reference to it without copying it again. The task is constructed
+ * in a block of the arena, and released by marking that block free.
+ */
+template <typename T>
+class PayloadTask : public ScheduledTask
+{
+public:
+    PayloadTask(void (*callback)(const T&), const T& payload, unsigned long delay)
+        : callback(callback)
+        , payload(payload)
+    {
+        timeout = delay; // made absolute when added to a Tasks
+    }
+    void call()
+    {
+        callback(payload);
+    }
+    void* operator new(size_t size, void* block)
+    {
+        return block;
+    }
+
+protected:
+    void release()
+    {
+        PayloadArena::release(this);
+    }
+
+private:
+    void (*callback)(const T&);
+    T payload;
+};
+
 /*
  * A ScheduledTask that can call back a method in an instance of a class
  * 
@@ -330,7 +743,7 @@ private:
  * "Callable" and implement the "callback()" method defined
  * in "Callable".
  */
-class MethodTask : public ScheduledTask
+class MethodTask final : public HeapTask<MethodTask>
 {
 public:
     MethodTask(Callable* listener, void* pointer, unsigned long delay);
@@ -0,0 +1,261 @@
+/*
+ * TasksEventLoop.cpp
+ *
+ * Author: PhoneDeveloper, LLC
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "TasksEventLoop.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// How many ready file descriptors to take from each epoll_wait()
+static const int MAX_EVENTS = 16;
+
+static const uint64_t NANOSECONDS_PER_MILLISECOND = 1000000;
+static const uint64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+static uint64_t monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+FdWatch::FdWatch(int fd, Pollable* listener, unsigned int events)
+    : fd(fd)
+    , events(events)
+    , occurred(0)
+    , listener(listener)
+    , node(this)
+{
+}
+
+int FdWatch::getFd()
+{
+    return fd;
+}
+
+/*
+ * callback - called by dispatch() after epoll reported the descriptor ready
+ */
+void FdWatch::callback(void* pointer)
+{
+    listener->ready(fd, occurred);
+}
+
+TasksEventLoop::TasksEventLoop(Tasks* tasks)
+    : tasks(tasks)
+{
+}
+
+TasksEventLoop::~TasksEventLoop()
+{
+    if(epollFd >= 0)
+    {
+        close(epollFd);
+    }
+    if(timerFd >= 0)
+    {
+        close(timerFd);
+    }
+    if(wakeFd >= 0)
+    {
+        close(wakeFd);
+    }
+}
+
+/*
+ * begin - creates the epoll instance, the timer and the wake-up eventfd
+ *
+ * The timer and the eventfd are registered with a NULL data pointer, which
+ * tells runOnce() they are not FdWatches. From here on, timer0_millis
+ * counts on from its current value in step with CLOCK_MONOTONIC.
+ */
+bool TasksEventLoop::begin()
+{
+    originNanoseconds = monotonicNanoseconds();
+    originMillis = timer0_millis;
+    elapsed = 0;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((epollFd < 0) || (timerFd < 0) || (wakeFd < 0))
+    {
+        return false;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    return (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == 0) &&
+           (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == 0);
+}
+
+/*
+ * watch - starts waiting for the watch's file descriptor to be ready
+ */
+bool TasksEventLoop::watch(FdWatch* watch)
+{
+    struct epoll_event event = {};
+    event.events = watch->events;
+    event.data.ptr = watch;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, watch->fd, &event) == 0;
+}
+
+/*
+ * unwatch - stops waiting for the watch's file descriptor, and cancels
+ * any call to its listener that has not been made yet
+ */
+bool TasksEventLoop::unwatch(FdWatch* watch)
+{
+    tasks->disarm(&watch->node);
+    return epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, NULL) == 0;
+}
+
+/*
+ * runOnce - waits for a task to be due or a file descriptor to be ready,
+ * then calls dispatch() until nothing more is ready
+ *
+ * Waits at most timeout milliseconds, or forever if timeout is -1.
+ */
+bool TasksEventLoop::runOnce(int timeout)
+{
+    updateClock();
+    if(!setTimer())
+    {
+        return false;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+    if(count < 0)
+    {
+        return errno == EINTR; // interrupted by a signal? not a failure
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        FdWatch* watch = (FdWatch*) events[i].data.ptr;
+        if(watch == NULL) // the timer or a wake(): just clear it
+        {
+            uint64_t discarded;
+            (void) read(timerFd, &discarded, sizeof(discarded));
+            (void) read(wakeFd, &discarded, sizeof(discarded));
+        }
+        else // queue the listener's call behind any tasks already due
+        {
+            watch->occurred = events[i].events;
+            tasks->arm(&watch->node, 0);
+        }
+    }
+
+    updateClock();
+    while(tasks->dispatch());
+    return true;
+}
+
+/*
+ * run - calls runOnce() until stop() is called
+ *
+ * Takes back the stop() that ends it, so the next run() runs again. A
+ * stop() that comes before run() is kept until then: that run() returns
+ * without dispatching, rather than the stop() being lost.
+ */
+bool TasksEventLoop::run()
+{
+    while(!__atomic_exchange_n(&stopped, false, __ATOMIC_RELAXED))
+    {
+        if(!runOnce())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * stop - makes run() return after the tasks it is dispatching
+ *
+ * Can be called from a task, or from another thread, even before run().
+ */
+void TasksEventLoop::stop()
+{
+    __atomic_store_n(&stopped, true, __ATOMIC_RELAXED);
+    wake();
+}
+
+/*
+ * wake - makes a waiting runOnce() return
+ *
+ * Call it from another thread after posting a task with Tasks::post(),
+ * so that the task does not wait for the next timeout or file descriptor.
+ */
+bool TasksEventLoop::wake()
+{
+    uint64_t one = 1;
+    return write(wakeFd, &one, sizeof(one)) == sizeof(one);
+}
+
+/*
+ * updateClock - sets timer0_millis from CLOCK_MONOTONIC
+ *
+ * elapsed counts the same milliseconds as timer0_millis, but in 64 bits
+ * and from begin(), so that setTimer() can turn a time in timer0_millis
+ * back into a CLOCK_MONOTONIC time even after timer0_millis overflows.
+ */
+void TasksEventLoop::updateClock()
+{
+    elapsed = (monotonicNanoseconds() - originNanoseconds) / NANOSECONDS_PER_MILLISECOND;
+    __atomic_store_n(&timer0_millis, originMillis + (unsigned long) elapsed, __ATOMIC_RELAXED);
+}
+
+/*
+ * setTimer - sets the timer to go off when the next task is due
+ *
+ * The timer is set to the CLOCK_MONOTONIC time at which updateClock()
+ * will make timer0_millis reach the task's timeout, to the nanosecond.
+ * If nothing is pending, the timer is turned off. If a task is already
+ * due, the time is in the past, so the timer goes off right away.
+ */
+bool TasksEventLoop::setTimer()
+{
+    struct itimerspec spec = {}; // all zero: turn the timer off
+    unsigned long timeout;
+    if(tasks->nextTimeout(&timeout))
+    {
+        long remaining = (long)(timeout - timer0_millis);
+        uint64_t due = originNanoseconds +
+                       (elapsed + (remaining > 0 ? remaining : 0)) * NANOSECONDS_PER_MILLISECOND;
+        spec.it_value.tv_sec = due / NANOSECONDS_PER_SECOND;
+        spec.it_value.tv_nsec = due % NANOSECONDS_PER_SECOND;
+    }
+    return timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef TasksEventLoop_h
+#define TasksEventLoop_h
+
+/**
+ * @file TasksEventLoop.h
+ * @author PhoneDeveloper, LLC
+ * @brief Runs Tasks on Linux without calling dispatch() over and over
+ *
+ * When code built on Tasks runs on a Linux computer rather than on an
+ * Arduino, it usually has sockets, pipes or serial ports to look after
+ * as well. TasksEventLoop lets one thread handle both: it sleeps in
+ * epoll_wait() until a file descriptor is ready or, using a timerfd set
+ * to the time the next task is due, until a task is ready to run.
+ *
+ * A file descriptor is watched using an FdWatch, which calls the ready()
+ * method of a Pollable. Readiness is delivered through the same dispatch()
+ * as scheduled tasks, so those callbacks run in order with the tasks.
+ *
+ * The loop keeps timer0_millis up to date itself, from CLOCK_MONOTONIC,
+ * so nothing else should change it while the loop is in use; the timer
+ * is set to the exact moment the next task's millisecond begins, rather
+ * than a whole number of milliseconds from whenever it was set.
+ * Only available when compiling for Linux.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#if defined(__linux__)
+
+#include "Tasks.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/*
+ * A class implementing this interface can be told when a file
+ * descriptor it watches using an FdWatch is ready. events holds
+ * the epoll events that occurred (EPOLLIN, EPOLLOUT, ...).
+ */
+class Pollable
+{
+public:
+    virtual void ready(int fd, unsigned int events) = 0;
+};
+
+/*
+ * Watches one file descriptor for a TasksEventLoop
+ *
+ * Declared by the sketch, like a TaskNode, and registered with
+ * TasksEventLoop::watch(). Each time epoll reports the descriptor
+ * ready, the watch is armed to run in the next dispatch(), where it
+ * calls listener->ready(). The watch must stay valid until unwatched.
+ */
+class FdWatch : public Callable
+{
+public:
+    FdWatch(int fd, Pollable* listener, unsigned int events = EPOLLIN);
+    int getFd();
+    void callback(void* pointer);
+
+private:
+    int fd;
+    unsigned int events;   // events to wait for
+    unsigned int occurred; // events reported by the last epoll_wait()
+    Pollable* listener;
+    TaskNode node;
+    friend class TasksEventLoop;
+};
+
+/*
+ * Waits for file descriptors and for scheduled tasks, then dispatches them
+ *
+ * Call begin() once, then either run(), which returns when stop() is
+ * called (straight away, if stop() was called before it), or runOnce()
+ * from your own loop. Both return false if a
+ * system call fails; errno tells you why.
+ */
+class TasksEventLoop
+{
+private:
+    Tasks* tasks;
+    int epollFd = -1;
+    int timerFd = -1;
+    int wakeFd = -1;
+    bool stopped = false; // set by stop(), cleared by the run() it stops; atomic: stop() may come from another thread
+    uint64_t originNanoseconds = 0; // CLOCK_MONOTONIC when begin() was called
+    unsigned long originMillis = 0; // timer0_millis when begin() was called
+    uint64_t elapsed = 0; // milliseconds since begin(), as of the last updateClock()
+    void updateClock();
+    bool setTimer();
+
+public:
+    TasksEventLoop(Tasks* tasks);
+    ~TasksEventLoop();
+    bool begin();
+    bool watch(FdWatch* watch);
+    bool unwatch(FdWatch* watch);
+    bool runOnce(int timeout = -1);
+    bool run();
+    void stop();
+    bool wake();
+};
+
+#endif
+#endif
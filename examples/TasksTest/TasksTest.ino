@@ -42,6 +42,8 @@
 
 #include <Callback.h>
 #include <Tasks.h>
+#include <CompactTasks.h>
+#include <TaskChannel.h>
 
 //
 // These are printed when the Arduino boots. Change version number 
@@ -51,7 +53,7 @@
 // 1.11.364 - major version 1, minor version 11, build 364.
 // At a minimum, update the build number whenever a change is made.
 //
-static const char* VERSION = "0.0.12";
+static const char* VERSION = "0.0.24";
 static const char* VERSION_STRING = "TasksTest test sketch version ";
 
 //
@@ -248,6 +250,23 @@ test(A_MemoryLeak) {
     tasks.dispatch();
   }
   assertEqual(mem, freeMemory());
+  {
+    Tasks tasks;
+    TaskDescriptor batch[] = {{pointerFunction, 0, NULL}, {pointerFunction, 0, NULL}};
+    tasks.scheduleBatch(batch, 2);
+    delay(2);
+    tasks.dispatch();
+    tasks.dispatch();
+  }
+  assertEqual(mem, freeMemory());
+  {
+    Tasks tasks;
+    TaskDescriptor batch[] = {{pointerFunction, 1000, NULL}, {pointerFunction, 0, NULL}};
+    tasks.scheduleBatch(batch, 2);
+    delay(2);
+    tasks.dispatch();
+  }
+  assertEqual(mem, freeMemory());
 }
 
 
@@ -462,6 +481,355 @@ test(CorrectOrder) {
 
 
 
+//
+// TaskNode test - can a node owned by an object be armed repeatedly,
+// disarmed, and re-armed from its own callback without using the heap?
+//
+class Blinker : public Callable {
+  public:
+    Blinker(Tasks* tasks) : tasks(tasks) {};
+    TaskNode node = TaskNode(this);
+    unsigned long count = 0;
+    bool armedWhenCalled = false;
+    void callback(void* pointer) {
+      count++;
+      armedWhenCalled = armedWhenCalled || node.isArmed();
+      tasks->arm(&node, 10);
+    }
+  private:
+    Tasks* tasks;
+};
+test(TaskNode) {
+  Tasks tasks;
+  Blinker blinker(&tasks);
+  unsigned long mem = freeMemory();
+  assertFalse(blinker.node.isArmed());
+  assertFalse(tasks.disarm(&blinker.node));
+  assertTrue(tasks.arm(&blinker.node, 0));
+  assertTrue(blinker.node.isArmed());
+  now = timer0_millis;
+  while(now + 45 > timer0_millis) tasks.dispatch();
+  assertEqual(5ul, blinker.count);  // at 0, 10, 20, 30 and 40
+  assertFalse(blinker.armedWhenCalled);  // disarmed before it is called
+  assertEqual(mem, freeMemory());
+  assertTrue(tasks.disarm(&blinker.node));
+  assertFalse(blinker.node.isArmed());
+  now = timer0_millis;
+  while(now + 20 > timer0_millis) tasks.dispatch();
+  assertEqual(5ul, blinker.count);  // no longer called
+}
+
+//
+// TaskNode destructor test - is a node that is destroyed while armed
+// taken out of the list, and is a copy of a node left unarmed?
+//
+test(TaskNodeDestroyedWhileArmed) {
+  Tasks tasks;
+  {
+    Blinker blinker(&tasks);
+    assertTrue(tasks.arm(&blinker.node, 0));
+    TaskNode copy(blinker.node);
+    assertFalse(copy.isArmed());
+  }  // blinker, and its armed node, are destroyed here
+  assertFalse(tasks.dispatch());  // nothing left to call
+  tasks.schedule(function, 0);
+  functionCalled = false;
+  assertTrue(tasks.dispatch());
+  assertTrue(functionCalled);
+}
+
+
+
+
+//
+// Pipeline test - are pipeline stages called in order, after the delay
+// of the edge that released them, and can the pipeline be run again?
+//
+// A --10ms--> B --> C --------> E
+//               \--> D --5ms--/
+//
+char stageNames[6];  // five stages and a terminating zero
+unsigned long stageTimes[6];
+int stageCount;
+void recordStage(char name) {
+  stageNames[stageCount] = name;
+  stageTimes[stageCount++] = timer0_millis - now;
+}
+void stageA() { recordStage('A'); }
+void stageB() { recordStage('B'); }
+void stageC() { recordStage('C'); }
+void stageD() { recordStage('D'); }
+void stageE() { recordStage('E'); }
+PipelineStage pipelineA(stageA), pipelineB(stageB), pipelineC(stageC), pipelineD(stageD), pipelineE(stageE);
+PipelineEdge edgeAB(&pipelineA, &pipelineB, 10);
+PipelineEdge edgeBC(&pipelineB, &pipelineC);
+PipelineEdge edgeBD(&pipelineB, &pipelineD);
+PipelineEdge edgeCE(&pipelineC, &pipelineE);
+PipelineEdge edgeDE(&pipelineD, &pipelineE, 5);
+test(Pipeline) {
+  Tasks tasks;
+  unsigned long mem = freeMemory();
+  for(int run=0; run<2; run++) {
+    stageCount = 0;
+    now = timer0_millis;
+    tasks.arm(&pipelineA, 0);
+    while(now + 20 > timer0_millis) tasks.dispatch();
+    assertEqual(5, stageCount);
+    assertTrue(compareStrings(stageNames, "ABCDE"));
+    assertTrue(stageTimes[1] >= 10 && stageTimes[1] <= 11);
+    assertEqual(stageTimes[1], stageTimes[2]);  // C and D called in the same dispatch() as B
+    assertEqual(stageTimes[1], stageTimes[3]);
+    assertTrue(stageTimes[4] >= stageTimes[3] + 5 && stageTimes[4] <= stageTimes[3] + 6);
+  }
+  assertEqual(mem, freeMemory());
+}
+
+// The same pipeline with B's edges declared the other way round, so that
+// E's edge from C (no delay) is counted after its edge from D (5ms).
+PipelineStage reversedA(stageA), reversedB(stageB), reversedC(stageC), reversedD(stageD), reversedE(stageE);
+PipelineEdge reversedAB(&reversedA, &reversedB, 10);
+PipelineEdge reversedBD(&reversedB, &reversedD);
+PipelineEdge reversedBC(&reversedB, &reversedC);
+PipelineEdge reversedDE(&reversedD, &reversedE, 5);
+PipelineEdge reversedCE(&reversedC, &reversedE);
+test(PipelineEdgeOrder) {
+  Tasks tasks;
+  stageCount = 0;
+  now = timer0_millis;
+  tasks.arm(&reversedA, 0);
+  while(now + 20 > timer0_millis) tasks.dispatch();
+  assertEqual(5, stageCount);
+  assertTrue(compareStrings(stageNames, "ABDCE"));
+  assertEqual(stageTimes[1], stageTimes[3]);  // C still called in the same dispatch() as B
+  assertTrue(stageTimes[4] >= stageTimes[2] + 5 && stageTimes[4] <= stageTimes[2] + 6);  // E still 5ms after D
+}
+
+
+
+
+//
+// Batch order test - are tasks added by scheduleBatch() called in the
+// correct order, along with tasks that were already pending?
+//
+int batchOrder[6];
+int batchCount;
+void storeOrder(void* index) {
+  batchOrder[batchCount++] = (int) index;
+}
+test(ScheduleBatchOrder) {
+  Tasks tasks;
+  batchCount = 0;
+  tasks.schedule(storeOrder, 10, (void*) 2);
+  TaskDescriptor batch[] = {
+    {storeOrder, 30, (void*) 5},
+    {storeOrder, 10, (void*) 3},  // due with the pending task; runs after it
+    {storeOrder, 0, (void*) 0},
+    {storeOrder, 20, (void*) 4},
+    {storeOrder, 0, (void*) 1},   // due with the one above; runs after it
+  };
+  assertTrue(tasks.scheduleBatch(batch, 5));
+  now = timer0_millis;
+  while(now + 40 > timer0_millis) tasks.dispatch();
+  assertEqual(6, batchCount);
+  for(int i=0; i<6; i++) {
+    assertEqual(i, batchOrder[i]);
+  }
+}
+
+
+
+
+//
+// Post test - are posted tasks held until dispatch() and then called in
+// order with tasks that were scheduled directly? Also tests ShardedTasks,
+// on boards that have it.
+//
+test(Post) {
+  Tasks tasks;
+  batchCount = 0;
+  tasks.schedule(storeOrder, 10, (void*) 2);
+  assertTrue(tasks.post(storeOrder, 0, (void*) 0));
+  assertTrue(tasks.post(storeOrder, 0, (void*) 1));
+  assertTrue(tasks.post(storeOrder, 20, (void*) 3));
+  now = timer0_millis;
+  while(now + 30 > timer0_millis) tasks.dispatch();
+  assertEqual(4, batchCount);
+  for(int i=0; i<4; i++) {
+    assertEqual(i, batchOrder[i]);
+  }
+#if defined(TASKS_LOCK_FREE_MAILBOX)
+  ShardedTasks<2> sharded;
+  functionCalled = false;
+  assertTrue(sharded.schedule(0, function, 0));
+  sharded.shard(1).dispatch();
+  assertFalse(functionCalled);  // still waiting for shard 0 to dispatch
+  sharded.shard(0).dispatch();
+  assertTrue(functionCalled);
+#endif
+}
+
+
+
+
+//
+// CompactTasks test - are tasks called in the correct order, without
+// using the heap, and does schedule() fail when the array is full?
+//
+test(CompactTasks) {
+  unsigned long mem = freeMemory();
+  CompactTasks<4> tasks;
+  size_t bytesPerTask = CompactTasks<4>::BYTES_PER_TASK;
+  Serial.print(bytesPerTask);
+  Serial.println(" (8) bytes per CompactTasks task");
+  assertEqual(8u, bytesPerTask);
+  now = timer0_millis;
+  assertTrue(tasks.schedule(storeMillis, 20, 2));
+  assertTrue(tasks.schedule(storeMillis, 10, 1));
+  assertTrue(tasks.schedule(storeMillis, 30, 3));
+  assertTrue(tasks.schedule(storeMillis, 0, 0));
+  assertFalse(tasks.schedule(storeMillis, 0, 4));      // full
+  assertEqual(mem, freeMemory());
+  while(now + 40 > timer0_millis) tasks.dispatch();
+  for(int i=0; i<4; i++) {
+    assertTrue(times[i] >= i*10 && times[i] <= (i*10)+1);
+  }
+  assertFalse(tasks.schedule(function, 70000ul));      // too long
+  assertTrue(tasks.schedule(function, 65535ul));
+}
+
+
+
+
+//
+// TaskChannel test - are all the messages pushed before dispatch() passed
+// to the consumer by a single task, without using the heap?
+//
+int messageSum;
+int messageCount;
+void sumMessages(const int& message) {
+  messageSum += message;
+  messageCount++;
+}
+test(TaskChannel) {
+  Tasks tasks;
+  TaskChannel<int, 4> channel(&tasks, sumMessages);
+  unsigned long mem = freeMemory();
+  messageSum = 0;
+  messageCount = 0;
+  for(int i=1; i<=4; i++) {
+    assertTrue(channel.push(i));
+  }
+  assertFalse(channel.push(5));  // full
+  assertEqual(4u, channel.available());
+  assertEqual(mem, freeMemory());
+  assertTrue(tasks.dispatch());    // one task for all four messages
+  assertEqual(4, messageCount);
+  assertEqual(10, messageSum);
+  assertEqual(0u, channel.available());
+  assertFalse(tasks.dispatch());
+  assertTrue(channel.push(6));     // and once more after the consumer ran
+  assertTrue(tasks.dispatch());
+  assertEqual(16, messageSum);
+}
+
+
+
+
+//
+// TaskChannel destroyed test - does a channel destroyed with messages
+// waiting leave nothing behind for dispatch() to call?
+//
+test(TaskChannelDestroyedWithMessages) {
+  Tasks tasks;
+  messageCount = 0;
+  {
+    TaskChannel<int, 4> channel(&tasks, sumMessages);
+    assertTrue(channel.push(1));
+    assertTrue(channel.push(2));
+  }  // the channel, and its armed node, are destroyed here
+  assertFalse(tasks.dispatch());  // nothing left to call
+  assertEqual(0, messageCount);
+  tasks.schedule(function, 0);
+  functionCalled = false;
+  assertTrue(tasks.dispatch());
+  assertTrue(functionCalled);
+}
+
+
+
+
+//
+// Payload test - are structs passed to their callbacks intact, from the
+// payload arena rather than the heap, and is the arena reused?
+//
+struct Reading {
+  int channel;
+  long value;
+  char units[8];
+};
+Reading lastReading;
+unsigned long readingCount;
+void storeReading(const Reading& reading) {
+  lastReading = reading;
+  readingCount++;
+}
+test(Payload) {
+  Tasks tasks;
+  Reading reading = {3, 123456l, "mV"};
+  assertFalse(tasks.schedule(storeReading, 0, reading));  // no arena yet
+  assertTrue(tasks.setPayloadArena(64));
+  unsigned long mem = freeMemory();
+  readingCount = 0;
+  for(int i=0; i<20; i++) {  // many more than fit in the arena at once
+    reading.value = i;
+    assertTrue(tasks.schedule(storeReading, 0, reading));
+    delay(1);
+    tasks.dispatch();
+    assertEqual((long) i, lastReading.value);
+  }
+  assertEqual(20ul, readingCount);
+  assertEqual(3, lastReading.channel);
+  assertTrue(compareStrings(lastReading.units, "mV"));
+  assertEqual(mem, freeMemory());
+  while(tasks.schedule(storeReading, 1000, reading));  // fill it up
+  assertFalse(tasks.setPayloadArena(128));  // tasks are still pending
+}
+
+
+
+
+//
+// Static schedule test - are static tasks called periodically from flash?
+//
+// Also verifies that installing a static schedule does not use the heap,
+// and that static tasks are interleaved with scheduled tasks.
+//
+unsigned long fastCount = 0;
+void fastFunction() { fastCount++; }
+unsigned long slowCount = 0;
+void slowFunction() { slowCount++; }
+TASKS_STATIC_SCHEDULE(testSchedule,
+  {fastFunction, 10},
+  {slowFunction, 25, 5});
+test(StaticSchedule) {
+  Tasks tasks;
+  fastCount = 0;
+  slowCount = 0;
+  functionCalled = false;
+  unsigned long mem = freeMemory();
+  now = timer0_millis;
+  assertTrue(tasks.setStaticSchedule(testSchedule, testScheduleDeadlines));
+  assertEqual(mem, freeMemory());
+  tasks.schedule(function, 15);
+  while(now + 100 > timer0_millis) tasks.dispatch();
+  assertTrue(fastCount >= 10 && fastCount <= 11);  // at 0, 10, 20 ... 90 (and maybe 100)
+  assertTrue(slowCount >= 4 && slowCount <= 5);    // at 5, 30, 55, 80 (and maybe 105)
+  assertTrue(functionCalled);
+}
+
+
+
+
 //
 // Loop speed tests - confirms that library still performs OK
 //
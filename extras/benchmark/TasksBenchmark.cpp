@@ -0,0 +1,497 @@
+/*
+ * TasksBenchmark.cpp
+ *
+ * Measures, and checks, Tasks and the other ways of queueing tasks in this
+ * library, on a computer rather than an Arduino. Build and run it with
+ * "make run" in this folder; "./benchmark seed scale" picks another random
+ * seed or makes the workloads longer.
+ *
+ * Each workload is a list of tasks to schedule, each at some millisecond
+ * and with some delay, generated from a random seed:
+ * - uniform: a steady trickle of tasks, some with delays up to a minute;
+ * - bursty: hundreds of short tasks at once, now and then;
+ * - periodic: many streams of tasks with the same few periods, so that
+ *   lots of tasks are due at exactly the same time;
+ * - wraparound: like uniform, starting just before timer0_millis overflows
+ *   (on a 64-bit computer, where unsigned long is 64 bits, that is 2^64
+ *   rather than the 2^32 of an Arduino, but it is the same arithmetic).
+ *
+ * The benchmark plays each workload against each configuration, advancing
+ * timer0_millis one millisecond at a time and calling dispatch() at most
+ * DISPATCHES_PER_MILLISECOND times in each, and records which task was
+ * called when. It plays the workload against a reference model too: a
+ * plain array of pending tasks, searched for the one due first (ties go
+ * to the task scheduled first). A configuration passes if it calls the
+ * same tasks, in the same order, at the same times as the model.
+ *
+ * Because time is simulated, a configuration that passes calls every task
+ * exactly as many simulated milliseconds late as the model does, so that
+ * lateness only reflects the dispatch budget and isn't reported. Instead,
+ * for each configuration it reports the real time, in nanoseconds, from
+ * the moment timer0_millis reached a task's due time to the moment the
+ * task was called (50th and 99th percentile, and worst): what it costs
+ * that configuration to find and call the tasks that are due. It also
+ * reports how many schedule() and dispatch() calls it made per second of
+ * real time. It exits with 1 if any configuration failed.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "Tasks.h"
+#include "CompactTasks.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+volatile unsigned long timer0_millis = 0;
+
+// How many times dispatch() is called each millisecond, at most
+static const int DISPATCHES_PER_MILLISECOND = 4;
+
+// The largest delay in any workload; CompactTasks can't go past 65535
+static const unsigned long MAX_DELAY = 60000;
+
+// Enough room in CompactTasks for the most tasks any workload has pending
+static const unsigned int COMPACT_SIZE = 8000;
+
+//
+// Workloads
+//
+
+/*
+ * One task to schedule: its id, the millisecond (counted from the start
+ * of the workload) at which to schedule it, and its delay.
+ */
+struct Operation
+{
+    int id;
+    unsigned long tick;
+    unsigned long delay;
+};
+
+struct Workload
+{
+    const char* name;
+    unsigned long start; // timer0_millis at the first tick
+    std::vector<Operation> operations; // in order of tick
+};
+
+/*
+ * A small random number generator (xorshift), so that a seed produces the
+ * same workloads everywhere.
+ */
+class Random
+{
+public:
+    Random(unsigned long seed) : state(seed * 2654435761ul + 1) {}
+    unsigned long below(unsigned long limit)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (unsigned long)(state % limit);
+    }
+
+private:
+    uint64_t state;
+};
+
+static void add(Workload& workload, unsigned long tick, unsigned long delay)
+{
+    Operation operation = {(int) workload.operations.size(), tick, delay};
+    workload.operations.push_back(operation);
+}
+
+static Workload uniform(Random& random, int scale, const char* name, unsigned long start)
+{
+    Workload workload = {name, start, std::vector<Operation>()};
+    for(unsigned long tick = 0; tick < 20000ul * scale; tick++)
+    {
+        int count = random.below(4); // 1.5 tasks per millisecond on average
+        for(int i = 0; i < count; i++)
+        {
+            bool longDelay = random.below(10) == 0;
+            add(workload, tick, random.below(longDelay ? MAX_DELAY : 1000));
+        }
+    }
+    return workload;
+}
+
+static Workload bursty(Random& random, int scale)
+{
+    Workload workload = {"bursty", 1000, std::vector<Operation>()};
+    for(unsigned long tick = 0; tick < 20000ul * scale; tick += 200 + random.below(600))
+    {
+        int count = 100 + random.below(400);
+        for(int i = 0; i < count; i++)
+        {
+            add(workload, tick, random.below(50));
+        }
+    }
+    return workload;
+}
+
+static Workload periodic(Random& random, int scale)
+{
+    static const unsigned long PERIODS[] = {10, 20, 50, 100, 1000};
+    Workload workload = {"periodic", 1000, std::vector<Operation>()};
+    unsigned long period[64];
+    unsigned long phase[64];
+    for(int stream = 0; stream < 64; stream++)
+    {
+        period[stream] = PERIODS[random.below(5)];
+        phase[stream] = random.below(period[stream]);
+    }
+    for(unsigned long tick = 0; tick < 20000ul * scale; tick++)
+    {
+        for(int stream = 0; stream < 64; stream++)
+        {
+            if(tick % period[stream] == phase[stream])
+            {
+                add(workload, tick, period[stream]);
+            }
+        }
+    }
+    return workload;
+}
+
+//
+// Configurations: the ways of queueing tasks being measured
+//
+
+/*
+ * The record of one task being called: its id, the time it was called (in
+ * timer0_millis), and when that was in real time, in nanoseconds since
+ * the workload started.
+ */
+struct Call
+{
+    int id;
+    unsigned long time;
+    long long nanoseconds;
+};
+
+static std::vector<Call> calls;
+static std::chrono::steady_clock::time_point began; // when the workload started
+
+static long long nanosecondsSinceBegan()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began).count();
+}
+
+static void record(int id)
+{
+    Call call = {id, timer0_millis, nanosecondsSinceBegan()};
+    calls.push_back(call);
+}
+
+static void recordPointer(void* id)
+{
+    record((int)(intptr_t) id);
+}
+
+class Configuration
+{
+public:
+    virtual ~Configuration() {}
+    virtual const char* name() = 0;
+    // schedules operations[first] up to, but not including, operations[last]
+    virtual bool schedule(const Operation* first, const Operation* last) = 0;
+    virtual bool dispatch() = 0;
+};
+
+class ScheduleEach : public Configuration
+{
+public:
+    const char* name() { return "Tasks"; }
+    bool schedule(const Operation* first, const Operation* last)
+    {
+        for(const Operation* operation = first; operation != last; operation++)
+        {
+            if(!tasks.schedule(record, operation->delay, operation->id))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool dispatch() { return tasks.dispatch(); }
+
+private:
+    Tasks tasks;
+};
+
+class ScheduleBatch : public Configuration
+{
+public:
+    const char* name() { return "Tasks::scheduleBatch"; }
+    bool schedule(const Operation* first, const Operation* last)
+    {
+        batch.clear();
+        for(const Operation* operation = first; operation != last; operation++)
+        {
+            TaskDescriptor descriptor = {recordPointer, operation->delay, (void*)(intptr_t) operation->id};
+            batch.push_back(descriptor);
+        }
+        return tasks.scheduleBatch(batch.data(), batch.size());
+    }
+    bool dispatch() { return tasks.dispatch(); }
+
+private:
+    Tasks tasks;
+    std::vector<TaskDescriptor> batch;
+};
+
+class Post : public Configuration
+{
+public:
+    const char* name() { return "Tasks::post"; }
+    bool schedule(const Operation* first, const Operation* last)
+    {
+        for(const Operation* operation = first; operation != last; operation++)
+        {
+            if(!tasks.post(record, operation->delay, operation->id))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool dispatch() { return tasks.dispatch(); }
+
+private:
+    Tasks tasks;
+};
+
+class Compact : public Configuration
+{
+public:
+    const char* name() { return "CompactTasks"; }
+    bool schedule(const Operation* first, const Operation* last)
+    {
+        for(const Operation* operation = first; operation != last; operation++)
+        {
+            if(!tasks.schedule(record, operation->delay, operation->id))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool dispatch() { return tasks.dispatch(); }
+
+private:
+    CompactTasks<COMPACT_SIZE> tasks;
+};
+
+/*
+ * The reference model: every pending task in an array, in the order they
+ * were scheduled. dispatch() calls the first one due, if any, and of the
+ * tasks due at the same time, the one scheduled first.
+ */
+class Model : public Configuration
+{
+public:
+    const char* name() { return "model"; }
+    bool schedule(const Operation* first, const Operation* last)
+    {
+        for(const Operation* operation = first; operation != last; operation++)
+        {
+            Call pending = {operation->id, timer0_millis + operation->delay, 0};
+            this->pending.push_back(pending);
+        }
+        return true;
+    }
+    bool dispatch()
+    {
+        size_t soonest = pending.size();
+        for(size_t i = 0; i < pending.size(); i++)
+        {
+            if((soonest == pending.size()) || ((long)(pending[soonest].time - pending[i].time) > 0))
+            {
+                soonest = i;
+            }
+        }
+        if((soonest == pending.size()) || ((long)(timer0_millis - pending[soonest].time) < 0))
+        {
+            return false;
+        }
+        int id = pending[soonest].id;
+        pending.erase(pending.begin() + soonest);
+        record(id);
+        return true;
+    }
+
+private:
+    std::vector<Call> pending; // time is when the task is due
+};
+
+//
+// Running a workload
+//
+
+struct Result
+{
+    std::vector<Call> calls;
+    std::vector<long long> ticks; // when each tick started, in nanoseconds since the workload started
+    bool scheduled; // false if a schedule() failed
+    double seconds;
+    unsigned long operations; // schedule() and dispatch() calls
+};
+
+/*
+ * Plays workload against configuration, until every task has been called
+ * (or the configuration has had a minute past the last delay to do so).
+ */
+static Result play(const Workload& workload, Configuration& configuration)
+{
+    Result result;
+    result.scheduled = true;
+    result.operations = 0;
+    calls.clear();
+    calls.reserve(workload.operations.size());
+
+    timer0_millis = workload.start;
+    const Operation* next = workload.operations.data();
+    const Operation* end = next + workload.operations.size();
+    unsigned long lastTick = workload.operations.empty() ? 0 : workload.operations.back().tick;
+
+    began = std::chrono::steady_clock::now();
+    for(unsigned long tick = 0; calls.size() < workload.operations.size() && tick <= lastTick + 2 * MAX_DELAY; tick++)
+    {
+        result.ticks.push_back(nanosecondsSinceBegan());
+        const Operation* first = next;
+        while((next != end) && (next->tick == tick))
+        {
+            next++;
+        }
+        if(first != next)
+        {
+            result.scheduled = configuration.schedule(first, next) && result.scheduled;
+            result.operations += next - first;
+        }
+        for(int i = 0; i < DISPATCHES_PER_MILLISECOND; i++)
+        {
+            result.operations++;
+            if(!configuration.dispatch())
+            {
+                break;
+            }
+        }
+        timer0_millis++;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+    result.calls.swap(calls);
+    return result;
+}
+
+/*
+ * Reports how long, in real time, the tasks in result waited once they
+ * were due, and whether the calls match expected. Returns true if they did.
+ */
+static bool report(const Workload& workload, const char* name, const Result& result, const Result& expected)
+{
+    std::vector<long long> latency;
+    for(size_t i = 0; i < result.calls.size(); i++)
+    {
+        const Operation& operation = workload.operations[result.calls[i].id];
+        unsigned long dueTick = operation.tick + operation.delay;
+        if(dueTick < result.ticks.size())
+        {
+            latency.push_back(result.calls[i].nanoseconds - result.ticks[dueTick]);
+        }
+    }
+    std::sort(latency.begin(), latency.end());
+
+    size_t mismatch = 0;
+    while((mismatch < result.calls.size()) && (mismatch < expected.calls.size()) &&
+          (result.calls[mismatch].id == expected.calls[mismatch].id) &&
+          (result.calls[mismatch].time == expected.calls[mismatch].time))
+    {
+        mismatch++;
+    }
+    bool passed = result.scheduled && (result.calls.size() == expected.calls.size()) &&
+                  (mismatch == result.calls.size());
+
+    printf("%-11s %-21s %8zu", workload.name, name, result.calls.size());
+    if(latency.empty())
+    {
+        printf(" %8s %8s %8s", "-", "-", "-");
+    }
+    else
+    {
+        printf(" %8lld %8lld %8lld", latency[latency.size() / 2], latency[latency.size() * 99 / 100],
+               latency.back());
+    }
+    printf(" %10.0f", result.seconds > 0 ? result.operations / result.seconds : 0.0);
+    if(passed)
+    {
+        printf("  ok\n");
+    }
+    else if(!result.scheduled)
+    {
+        printf("  FAILED: schedule() returned false\n");
+    }
+    else
+    {
+        printf("  FAILED: call %zu differs from the model\n", mismatch);
+    }
+    return passed;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long seed = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1;
+    int scale = (argc > 2) ? atoi(argv[2]) : 1;
+    if(scale < 1)
+    {
+        scale = 1;
+    }
+
+    Random random(seed);
+    std::vector<Workload> workloads;
+    workloads.push_back(uniform(random, scale, "uniform", 1000));
+    workloads.push_back(bursty(random, scale));
+    workloads.push_back(periodic(random, scale));
+    workloads.push_back(uniform(random, scale, "wraparound", (unsigned long) -1 - 5000));
+
+    printf("seed %lu, scale %d, %d dispatches per millisecond\n", seed, scale, DISPATCHES_PER_MILLISECOND);
+    printf("%-11s %-21s %8s %8s %8s %8s %10s\n", "workload", "configuration", "tasks", "p50 ns", "p99 ns",
+           "max ns", "ops/s");
+
+    bool passed = true;
+    for(size_t w = 0; w < workloads.size(); w++)
+    {
+        Model model;
+        Result expected = play(workloads[w], model);
+        report(workloads[w], model.name(), expected, expected);
+
+        Configuration* configurations[] = {new ScheduleEach, new ScheduleBatch, new Post, new Compact};
+        for(size_t c = 0; c < sizeof(configurations) / sizeof(configurations[0]); c++)
+        {
+            Result result = play(workloads[w], *configurations[c]);
+            passed = report(workloads[w], configurations[c]->name(), result, expected) && passed;
+            delete configurations[c];
+        }
+    }
+    return passed ? 0 : 1;
+}
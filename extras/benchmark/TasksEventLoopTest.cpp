@@ -0,0 +1,274 @@
+/*
+ * TasksEventLoopTest.cpp
+ *
+ * Checks TasksEventLoop on a Linux computer. Build and run it with
+ * "make test" in this folder.
+ *
+ * - timers: tasks scheduled out of order are called in order, when they
+ *   are due, with the loop keeping timer0_millis up to date by itself;
+ * - pipe: a file descriptor that becomes readable calls its Pollable,
+ *   in order with the tasks around it;
+ * - threads: another thread wake()s the loop, which has nothing else to
+ *   wait for, then stop()s it;
+ * - early stop: a stop() from another thread before run() makes run()
+ *   return straight away, and only that run();
+ * - post: other threads post() tasks and wake() the loop while it keeps
+ *   timer0_millis up to date; the loop calls every one of them, and
+ *   none before its delay is up.
+ *
+ * A loop that never wakes up would hang, so the test gives up after a
+ * few seconds. It exits with 1 if any check failed.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "TasksEventLoop.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+volatile unsigned long timer0_millis = (unsigned long) -1 - 20; // overflows during the timers test
+
+// How late a task may be called, in real time, before the test fails. It
+// can also be up to a millisecond early: delays count from the start of
+// the millisecond in which a task is scheduled.
+static const long LATENESS_LIMIT_MICROSECONDS = 20000;
+
+static std::chrono::steady_clock::time_point began;
+static unsigned long beganMillis;
+static std::string order;
+static long worstLateness = -1000000; // in microseconds
+static bool passed = true;
+
+static void check(bool condition, const char* what)
+{
+    if(!condition)
+    {
+        printf("FAILED: %s\n", what);
+        passed = false;
+    }
+}
+
+static Tasks tasks;
+static TasksEventLoop eventLoop(&tasks);
+
+/*
+ * Records that the task with the given name, scheduled delay milliseconds
+ * after the test began, has been called, and how late it was.
+ */
+static void called(char name, unsigned long delay)
+{
+    order += name;
+    long lateness = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - began).count() - (long) delay * 1000;
+    worstLateness = std::max(worstLateness, lateness);
+    check((long)(timer0_millis - beganMillis - delay) >= 0, "a task was called before timer0_millis said it was due");
+}
+
+static void task10(char name) { called(name, 10); }
+static void task20(char name) { called(name, 20); }
+static void task30(char name) { called(name, 30); }
+static void stopLoop() { eventLoop.stop(); }
+
+static void testTimers()
+{
+    order.clear();
+    began = std::chrono::steady_clock::now();
+    beganMillis = timer0_millis;
+    tasks.schedule(task30, 30, 'c');
+    tasks.schedule(task10, 10, 'a');
+    tasks.schedule(task20, 20, 'b');
+    tasks.schedule(stopLoop, 40);
+    check(eventLoop.run(), "run() failed");
+    check(order == "abc", "timers were not called in order");
+    check(worstLateness > -1000 && worstLateness < LATENESS_LIMIT_MICROSECONDS, "a timer was called too early or too late");
+    check((long)(timer0_millis - beganMillis) >= 40, "timer0_millis did not keep up");
+    printf("timers: order %s, worst lateness %ld us\n", order.c_str(), worstLateness);
+}
+
+/*
+ * Reads whatever was written to the pipe and records it.
+ */
+class PipeReader : public Pollable
+{
+public:
+    void ready(int fd, unsigned int events)
+    {
+        char data[16];
+        ssize_t count = read(fd, data, sizeof(data));
+        if(count > 0)
+        {
+            order.append(data, count);
+        }
+    }
+};
+
+static int pipeFds[2];
+
+static void writePipe(char data)
+{
+    order += '>';
+    check(write(pipeFds[1], &data, 1) == 1, "could not write to the pipe");
+}
+
+static void recordAfter(char name)
+{
+    order += name;
+}
+
+static void testPipe()
+{
+    check(pipe(pipeFds) == 0, "could not create a pipe");
+    PipeReader reader;
+    FdWatch pipeWatch(pipeFds[0], &reader);
+    check(eventLoop.watch(&pipeWatch), "watch() failed");
+
+    order.clear();
+    tasks.schedule(writePipe, 5, 'x');
+    tasks.schedule(recordAfter, 15, '.');
+    tasks.schedule(stopLoop, 20);
+    check(eventLoop.run(), "run() failed");
+    check(order == ">x.", "the pipe was not read in order with the tasks");
+    printf("pipe: order %s\n", order.c_str());
+
+    check(eventLoop.unwatch(&pipeWatch), "unwatch() failed");
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+
+static void wakeThenStop()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    check(eventLoop.wake(), "wake() failed");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    eventLoop.stop();
+}
+
+static void testThreads()
+{
+    check(eventLoop.runOnce(0), "runOnce() failed"); // clear the wake-up left by the last stop()
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread other(wakeThenStop);
+    check(eventLoop.runOnce(), "runOnce() failed"); // nothing pending: returns only when woken
+    long woken = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    check(eventLoop.run(), "run() failed"); // returns only when stopped
+    long stopped = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    other.join();
+    check(woken >= 20 && stopped >= 40, "the loop returned before it was woken or stopped");
+    printf("threads: woken after %ld ms, stopped after %ld ms\n", woken, stopped);
+}
+
+static void testEarlyStop()
+{
+    std::thread other(&TasksEventLoop::stop, &eventLoop);
+    other.join();
+    check(eventLoop.run(), "run() failed"); // nothing pending: returns only if the stop() was kept
+    order.clear();
+    tasks.schedule(recordAfter, 5, '.');
+    tasks.schedule(stopLoop, 10);
+    check(eventLoop.run(), "run() failed");
+    check(order == ".", "the next run() was stopped too");
+    printf("early stop: order %s\n", order.c_str());
+}
+
+static const int POSTERS = 4;
+static const int POSTS_PER_POSTER = 50;
+static int postedCalls = 0; // only touched by the loop's thread
+
+static long millisecondsSinceBegan()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - began).count();
+}
+
+/*
+ * Called for each posted task; due is when, in real milliseconds since the
+ * test began, the task was posted plus its delay.
+ */
+static void countPosted(long due)
+{
+    postedCalls++;
+    check(millisecondsSinceBegan() >= due - 1, "a posted task was called before its delay was up");
+    if(postedCalls == POSTERS * POSTS_PER_POSTER)
+    {
+        eventLoop.stop();
+    }
+}
+
+/*
+ * Posts from another thread, which must not read timer0_millis: the loop
+ * keeps writing it.
+ */
+static void postAndWake(int poster)
+{
+    for(int i = 0; i < POSTS_PER_POSTER; i++)
+    {
+        unsigned long delay = (poster + i) % 3;
+        check(tasks.post(countPosted, delay, millisecondsSinceBegan() + (long) delay), "post() failed");
+        check(eventLoop.wake(), "wake() failed");
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+static void testPost()
+{
+    began = std::chrono::steady_clock::now();
+    std::vector<std::thread> posters;
+    for(int poster = 0; poster < POSTERS; poster++)
+    {
+        posters.push_back(std::thread(postAndWake, poster));
+    }
+    check(eventLoop.run(), "run() failed"); // returns when the last posted task stops it
+    for(size_t i = 0; i < posters.size(); i++)
+    {
+        posters[i].join();
+    }
+    check(postedCalls == POSTERS * POSTS_PER_POSTER, "not every posted task was called");
+    printf("post: %d threads, %d tasks called\n", POSTERS, postedCalls);
+}
+
+static void timedOut(int signal)
+{
+    static const char message[] = "FAILED: the event loop did not wake up\n";
+    (void) write(1, message, sizeof(message) - 1);
+    _exit(1);
+}
+
+int main()
+{
+    signal(SIGALRM, timedOut);
+    alarm(5);
+    if(!eventLoop.begin())
+    {
+        printf("FAILED: begin()\n");
+        return 1;
+    }
+    testTimers();
+    testPipe();
+    testThreads();
+    testEarlyStop();
+    testPost();
+    printf("event loop: %s\n", passed ? "ok" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+/*
+ * TasksPostTest.cpp
+ *
+ * Checks Tasks::post() with several threads posting at once, on a computer
+ * rather than an Arduino. Build and run it with "make test" in this folder;
+ * it is worth running under ThreadSanitizer too:
+ * make test CXXFLAGS="-O1 -g -fsanitize=thread"
+ *
+ * PRODUCERS threads each post TASKS_PER_PRODUCER tasks to one Tasks, with
+ * no delay, while the main thread calls dispatch() on it. Every task must
+ * be called exactly once, and the tasks posted by each thread must be
+ * called in the order that thread posted them. It exits with 1 if not.
+ *
+ * Copyright (c) 2015, PhoneDeveloper, LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "Tasks.h"
+
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+volatile unsigned long timer0_millis = 0;
+
+static const int PRODUCERS = 4;
+static const int TASKS_PER_PRODUCER = 20000;
+
+static Tasks tasks;
+static int nextExpected[PRODUCERS]; // only touched by the dispatching thread
+static int received = 0;
+static int outOfOrder = 0;
+
+/*
+ * The task: value is the posting thread's number times TASKS_PER_PRODUCER,
+ * plus how many tasks that thread had posted before this one.
+ */
+static void receive(int value)
+{
+    int producer = value / TASKS_PER_PRODUCER;
+    int sequence = value % TASKS_PER_PRODUCER;
+    if(sequence != nextExpected[producer])
+    {
+        outOfOrder++;
+    }
+    nextExpected[producer] = sequence + 1;
+    received++;
+}
+
+static void produce(int producer)
+{
+    for(int sequence = 0; sequence < TASKS_PER_PRODUCER; sequence++)
+    {
+        while(!tasks.post(receive, 0, producer * TASKS_PER_PRODUCER + sequence))
+        {
+            std::this_thread::yield(); // out of memory: let dispatch() catch up
+        }
+    }
+}
+
+int main()
+{
+    std::vector<std::thread> producers;
+    for(int producer = 0; producer < PRODUCERS; producer++)
+    {
+        producers.push_back(std::thread(produce, producer));
+    }
+    while(received < PRODUCERS * TASKS_PER_PRODUCER)
+    {
+        if(!tasks.dispatch())
+        {
+            std::this_thread::yield();
+        }
+    }
+    for(size_t i = 0; i < producers.size(); i++)
+    {
+        producers[i].join();
+    }
+
+    bool passed = (outOfOrder == 0) && !tasks.dispatch();
+    printf("post: %d threads, %d tasks called, %d out of order  %s\n", PRODUCERS, received, outOfOrder,
+           passed ? "ok" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/*
+ * Just enough of Arduino.h to compile Tasks on a computer, for the benchmark.
+ * timer0_millis is defined, and advanced, by the benchmark itself.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PROGMEM
+#define memcpy_P memcpy
+
+class String : public std::string
+{
+public:
+    String(const char* value = "") : std::string(value) {}
+};
+
+#endif